@@ -0,0 +1,278 @@
+/*
+ * decode_idb - decode the IDBlocks of an IDB dump
+ *
+ * Reads what rkflashtool i writes (sectors of 528 bytes: 512 data, 16
+ * spare) or a plain image of 512 byte sectors (-s 512), from a file or
+ * stdin, and looks for IDBlocks in it. An IDBlock starts with four header
+ * sectors, of which 0, 2 and 3 are RC4 scrambled, followed by the flash
+ * data (DRAM init) and flash boot (loader) sectors. For every IDBlock
+ * found the headers are printed one field per line, with the CRCs sector
+ * 2 keeps of the other sectors and of the boot code checked, so that the
+ * output of many boards can be compared with grep and diff.
+ *
+ * usage: decode_idb [-s 512|528] [dump]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../rkcrc.h"
+
+#define SECTOR		512
+#define IDB_TAG		0x0ff0aa55
+
+#pragma pack(push, 1)
+struct sec0 {
+	uint32_t tag;
+	uint8_t reserved[4];
+	uint32_t rc4_flag;
+	uint16_t boot_code1_offset;
+	uint16_t boot_code2_offset;
+	uint8_t reserved1[490];
+	uint16_t boot_data_size;	/* flash data, sectors */
+	uint16_t boot_code_size;	/* flash data and flash boot */
+	uint16_t crc;
+};
+
+struct sec1 {
+	uint16_t sys_reserved_block;
+	uint16_t disk_size[4];
+	uint32_t chip_tag;
+	uint32_t machine_id;
+	uint16_t loader_year;
+	uint16_t loader_date;
+	uint16_t loader_ver;
+	uint16_t last_loader_ver;
+	uint16_t read_write_times;
+	uint32_t fw_ver;
+	uint16_t machine_info_len;
+	uint8_t machine_info[30];
+	uint16_t manufactory_info_len;
+	uint8_t manufactory_info[30];
+	uint16_t flash_info_offset;
+	uint16_t flash_info_len;
+	uint8_t reserved[384];
+	uint32_t flash_size;		/* sectors */
+	uint8_t reserved1;
+	uint8_t access_time;
+	uint16_t block_size;
+	uint8_t page_size;
+	uint8_t ecc_bits;
+	uint8_t reserved2[8];
+	uint16_t id_block[5];
+};
+
+struct sec2 {
+	uint16_t info_size;
+	uint8_t chip_info[16];
+	uint8_t reserved[473];
+	char vc_tag[3];
+	uint16_t sec0_crc;
+	uint16_t sec1_crc;
+	uint32_t boot_code_crc;
+	uint16_t sec3_custom_data_offset;
+	uint16_t sec3_custom_data_size;
+	char crc_tag[4];
+	uint16_t sec3_crc;
+};
+
+struct sec3 {
+	uint16_t sn_size;
+	uint8_t sn[30];
+};
+#pragma pack(pop)
+
+static const uint8_t rc4_key[16] = {
+	124, 78, 3, 4, 85, 5, 9, 7, 45, 44, 123, 56, 23, 13, 23, 17
+};
+
+static uint8_t *dump;
+static size_t nsectors, secsize = 528;
+
+/* The scrambling is RC4 with a fixed key, started over for every sector */
+static void rc4(uint8_t *p, size_t len)
+{
+	uint8_t s[256], t;
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+		s[i] = i;
+	for (i = j = 0; i < 256; i++) {
+		j = (j + s[i] + rc4_key[i % 16]) & 0xff;
+		t = s[i]; s[i] = s[j]; s[j] = t;
+	}
+	for (i = j = 0; len--; p++) {
+		i = (i + 1) & 0xff;
+		j = (j + s[i]) & 0xff;
+		t = s[i]; s[i] = s[j]; s[j] = t;
+		*p ^= s[(s[i] + s[j]) & 0xff];
+	}
+}
+
+static void sector(size_t n, uint8_t *out, int scrambled)
+{
+	memcpy(out, dump + n * secsize, SECTOR);
+	if (scrambled)
+		rc4(out, SECTOR);
+}
+
+static const char *check(uint32_t want, uint32_t got)
+{
+	return want == got ? "ok" : "BAD";
+}
+
+/* Prints a string field of the header, up to len bytes */
+static void field(const char *name, const uint8_t *p, size_t len)
+{
+	size_t i;
+
+	printf("%-24s ", name);
+	for (i = 0; i < len && p[i]; i++)
+		putchar(p[i] >= ' ' && p[i] <= '~' ? p[i] : '.');
+	putchar('\n');
+}
+
+static void decode(int idx, size_t at)
+{
+	uint8_t b0[SECTOR], b1[SECTOR], b2[SECTOR], b3[SECTOR], *code;
+	struct sec0 *s0 = (struct sec0 *)b0;
+	struct sec1 *s1 = (struct sec1 *)b1;
+	struct sec2 *s2 = (struct sec2 *)b2;
+	struct sec3 *s3 = (struct sec3 *)b3;
+	size_t i, ncode;
+	int v;
+
+	sector(at, b0, 1);
+	sector(at + 1, b1, 0);
+	sector(at + 2, b2, 1);
+	sector(at + 3, b3, 1);
+
+	printf("idblock %d\n", idx);
+	printf("%-24s 0x%zx\n", "sector", at);
+	printf("%-24s %u\n", "rc4_flag", s0->rc4_flag);
+	printf("%-24s 0x%x 0x%x\n", "boot_code_offset",
+	       s0->boot_code1_offset, s0->boot_code2_offset);
+	printf("%-24s 0x%x\n", "flash_data_sectors", s0->boot_data_size);
+	printf("%-24s 0x%x\n", "flash_boot_sectors",
+	       s0->boot_code_size - s0->boot_data_size);
+
+	printf("%-24s 0x%08x\n", "chip_tag", s1->chip_tag);
+	printf("%-24s 0x%08x\n", "machine_id", s1->machine_id);
+	printf("%-24s %04x-%04x\n", "loader_date", s1->loader_year,
+	       s1->loader_date);
+	printf("%-24s 0x%04x\n", "loader_ver", s1->loader_ver);
+	printf("%-24s 0x%04x\n", "last_loader_ver", s1->last_loader_ver);
+	printf("%-24s %u\n", "read_write_times", s1->read_write_times);
+	printf("%-24s 0x%08x\n", "fw_ver", s1->fw_ver);
+	field("machine_info", s1->machine_info,
+	      s1->machine_info_len < 30 ? s1->machine_info_len : 30);
+	field("manufactory_info", s1->manufactory_info,
+	      s1->manufactory_info_len < 30 ? s1->manufactory_info_len : 30);
+	printf("%-24s 0x%x\n", "sys_reserved_blocks", s1->sys_reserved_block);
+	printf("%-24s 0x%x 0x%x 0x%x 0x%x\n", "disk_sizes",
+	       s1->disk_size[0], s1->disk_size[1], s1->disk_size[2],
+	       s1->disk_size[3]);
+	printf("%-24s 0x%08x\n", "flash_size", s1->flash_size);
+	printf("%-24s 0x%x\n", "flash_block_size", s1->block_size);
+	printf("%-24s 0x%x\n", "flash_page_size", s1->page_size);
+	printf("%-24s %u\n", "flash_ecc_bits", s1->ecc_bits);
+	printf("%-24s %u\n", "flash_access_time", s1->access_time);
+	printf("%-24s %u %u %u %u %u\n", "id_blocks", s1->id_block[0],
+	       s1->id_block[1], s1->id_block[2], s1->id_block[3],
+	       s1->id_block[4]);
+
+	field("chip_info", s2->chip_info, sizeof(s2->chip_info));
+	field("sn", s3->sn, s3->sn_size < 30 ? s3->sn_size : 30);
+
+	/* sector 2 has the CRCs of the others as they are before scrambling */
+	if (memcmp(s2->crc_tag, "CRC", 3)) {
+		printf("%-24s none\n", "crc");
+		putchar('\n');
+		return;
+	}
+	printf("%-24s 0x%04x %s\n", "sec0_crc", s2->sec0_crc,
+	       check(s2->sec0_crc, rkcrc16(0, b0, SECTOR)));
+	printf("%-24s 0x%04x %s\n", "sec1_crc", s2->sec1_crc,
+	       check(s2->sec1_crc, rkcrc16(0, b1, SECTOR)));
+	printf("%-24s 0x%04x %s\n", "sec3_crc", s2->sec3_crc,
+	       check(s2->sec3_crc, rkcrc16(0, b3, SECTOR)));
+
+	/* the boot code CRC is over the sectors as stored */
+	ncode = s0->boot_code_size;
+	if (at + 4 + ncode > nsectors) {
+		printf("%-24s 0x%08x truncated\n", "boot_code_crc",
+		       s2->boot_code_crc);
+		putchar('\n');
+		return;
+	}
+	if (!(code = malloc(ncode * SECTOR + 1))) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < ncode; i++)
+		sector(at + 4 + i, code + i * SECTOR, 0);
+	v = rkcrc32(0, code, ncode * SECTOR) == s2->boot_code_crc;
+	printf("%-24s 0x%08x %s\n", "boot_code_crc", s2->boot_code_crc,
+	       v ? "ok" : "BAD");
+	free(code);
+	putchar('\n');
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f = stdin;
+	size_t len = 0, alloc = 0, n, i;
+	uint8_t b[SECTOR];
+	int opt, found = 0;
+
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			secsize = strtoul(optarg, NULL, 0);
+			if (secsize != 512 && secsize != 528)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind < argc - 1) {
+usage:
+		fprintf(stderr, "usage: %s [-s 512|528] [dump]\n", argv[0]);
+		return 1;
+	}
+	if (optind == argc - 1 && !(f = fopen(argv[optind], "rb"))) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	do {
+		if (len == alloc) {
+			alloc = alloc ? alloc * 2 : 1 << 20;
+			if (!(dump = realloc(dump, alloc))) {
+				perror("realloc");
+				return 1;
+			}
+		}
+		n = fread(dump + len, 1, alloc - len, f);
+		len += n;
+	} while (n);
+	if (f != stdin)
+		fclose(f);
+	nsectors = len / secsize;
+
+	for (i = 0; i + 4 <= nsectors; i++) {
+		sector(i, b, 1);
+		if (((struct sec0 *)b)->tag != IDB_TAG)
+			continue;
+		decode(found++, i);
+	}
+	if (!found) {
+		fprintf(stderr, "no IDBlock in %zu sectors\n", nsectors);
+		return 1;
+	}
+	return 0;
+}
@@ -1,123 +1,331 @@
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <pcap.h>
-#include <sys/mman.h>
-#include <unistd.h>
+/*
+ * decode_pcap - Rockchip loader protocol analyzer for USB captures
+ *
+ * Reads a pcap file, as written by USBPcap (Windows), by Linux usbmon
+ * (tcpdump -i usbmonN, Wireshark) or by rkflashtool --trace, one record at
+ * a time, so captures of any size work. CBWs are decoded into command
+ * names and paired with their data phase and, by tag, with their CSW.
+ * At the end it reports, per command, count, errors, bytes, latency (CBW
+ * to CSW) and throughput, and the idle time between commands.
+ *
+ * usage: decode_pcap [-v] [-f firmware.bin] capture.pcap
+ *
+ *   -v     print every command as it completes
+ *   -f     where to put the WRITESECTOR payloads (default firmware.bin)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <unistd.h>
+
+#include "../rkpcap.h"
+
+#define MAX_PENDING	64	/* commands sent, no CSW seen yet */
+#define MAX_STATS	64
+#define GAP_REPORT	0.001	/* s, gaps shorter than this are not idle */
+
+struct cmd {
+	uint32_t tag, command, offset, count;
+	uint32_t expect;	/* data phase length, 0 if not known */
+	uint64_t bytes;
+	int data_done;
+	double t_cbw;
+};
+
+struct cmdstat {
+	uint32_t command;
+	uint64_t n, errors, bytes;
+	double sum, min, max;
+};
 
-typedef unsigned int guint32;
-typedef unsigned short guint16;
-typedef int gint32;
+static struct cmd pending[MAX_PENDING];
+static int npending;
+static struct cmdstat stats[MAX_STATS];
+static int nstats;
 
-typedef struct pcaprec_hdr_s {
-        guint32 ts_sec;         /* timestamp seconds */
-        guint32 ts_usec;        /* timestamp microseconds */
-        guint32 incl_len;       /* number of octets of packet saved in file */
-        guint32 orig_len;       /* actual length of packet */
-} pcaprec_hdr_t;
+static int verbose;
 
-#pragma pack(1)
-typedef struct
+static double t_first = -1, t_last, t_idle_from = -1;
+static double idle_sum, idle_max, idle_max_at;
+static uint64_t idle_n;
+static uint64_t nrecords, ncontrol, control_bytes, nerrors;
+static uint64_t unmatched, unanswered;
+
+static FILE *fw_file;
+static int fw_count;
+
+static uint32_t get_be32(const uint8_t *p)
 {
-    uint16_t       headerLen; /* This header length */
-    uint64_t       irpId;     /* I/O Request packet ID */
-    uint32_t	   status;    /* USB status code
-                               (on return from host controller) */
-    uint16_t       function;  /* URB Function */
-    uint8_t        info;      /* I/O Request info */
-
-    uint16_t       bus;       /* bus (RootHub) number */
-    uint16_t       device;    /* device address */
-    uint8_t        endpoint;  /* endpoint number and transfer direction */
-    uint8_t        transfer;  /* transfer type */
-
-    uint32_t       dataLength;/* Data length */
-	uint8_t	   stage;
-} USBPCAP_BUFFER_PACKET_HEADER, *PUSBPCAP_BUFFER_PACKET_HEADER;
+	return rkpcap_get32(p, 1);
+}
 
-int main(int argc, char *argv[])
+static const char *command_name(uint32_t command)
 {
-	void *base;
-	struct stat info;
-	int fd, offset;
-	pcaprec_hdr_t *rec_hdr;
-	struct pcap_file_header *pcap_header;
-	PUSBPCAP_BUFFER_PACKET_HEADER usb_pkt_hdr;
-
-	stat(argv[1], &info);
-
-	fd = open(argv[1], O_RDONLY);
-	if (fd < 0) {
-		perror("open");
-		return -1;
-	}
+	static char s[16];
+	const char *name = rkpcap_command_name(command);
+
+	if (name)
+		return name;
+	snprintf(s, sizeof(s), "0x%08x", command);
+	return s;
+}
+
+static struct cmdstat *get_stat(uint32_t command)
+{
+	int i;
+
+	for (i = 0; i < nstats; i++)
+		if (stats[i].command == command)
+			return &stats[i];
+	if (nstats == MAX_STATS)
+		return &stats[MAX_STATS - 1];
+	memset(&stats[nstats], 0, sizeof(stats[0]));
+	stats[nstats].command = command;
+	stats[nstats].min = 1e9;
+	return &stats[nstats++];
+}
+
+static void finish(struct cmd *c, double t, int status)
+{
+	struct cmdstat *st = get_stat(c->command);
+	double lat = t - c->t_cbw;
 
-	base = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (base == MAP_FAILED)
-		perror("mmap");
+	st->n++;
+	st->bytes += c->bytes;
+	st->sum += lat;
+	if (lat < st->min) st->min = lat;
+	if (lat > st->max) st->max = lat;
+	if (status) st->errors++;
 
-	offset = 0;
-	pcap_header = (struct pcap_file_header *)(base + offset);
-	printf("magic: 0x%08x\n", pcap_header->magic);
-	printf("linktype: %d\n", pcap_header->linktype);
-	printf("pcap_file_header len: %ld\n", sizeof(struct pcap_file_header));
-	offset += sizeof(struct pcap_file_header);
+	if (verbose)
+		printf("%12.6f %-16s 0x%08x %6u %8llu bytes %9.3f ms%s\n",
+		       c->t_cbw - t_first, command_name(c->command), c->offset,
+		       c->count, (unsigned long long)c->bytes, lat * 1000,
+		       status ? " FAILED" : "");
+}
+
+static void cbw(const struct rkpcap_rec *r)
+{
+	struct cmd *c;
+	const uint8_t *d = r->data;
+
+	/* the device idled from the last CSW up to here */
+	if (!npending && t_idle_from >= 0) {
+		double gap = r->t - t_idle_from;
+		if (gap >= GAP_REPORT) {
+			idle_n++;
+			idle_sum += gap;
+			if (gap > idle_max) {
+				idle_max = gap;
+				idle_max_at = t_idle_from - t_first;
+			}
+		}
+	}
 
-	FILE *c_header_file = fopen("firmware.h", "w");
+	if (npending == MAX_PENDING) {
+		unanswered++;
+		memmove(pending, pending + 1, --npending * sizeof(pending[0]));
+	}
+	c = &pending[npending++];
+	memset(c, 0, sizeof(*c));
+	c->tag = get_be32(d + 4);
+	c->command = get_be32(d + 12);
+	c->offset = get_be32(d + 17);
+	c->count = d[22] << 8 | d[23];
+	c->t_cbw = r->t;
+	switch (c->command) {
+	case 0x80000a14:	/* ReadLBA */
+	case 0x00000a15:	/* WriteLBA */
+		c->expect = c->count * 512;
+		break;
+	case 0x80000a17:	/* ReadSDRAM */
+	case 0x00000a18:	/* WriteSDRAM */
+		c->expect = c->count;
+		break;
+	}
+}
 
-	rewind(c_header_file);
-	fprintf(c_header_file, "typedef struct {\n\tint len;\n\tuint8_t data[8448];\n} dram_t;\n\ndram_t firmware[] = {\n\t");
+static void csw(const struct rkpcap_rec *r)
+{
+	int i;
 
+	for (i = 0; i < npending; i++)
+		if (pending[i].tag == get_be32(r->data + 4))
+			break;
+	if (i == npending) {
+		unmatched++;
+		return;
+	}
+	/* older commands never got theirs */
+	unanswered += i;
+	finish(&pending[i], r->t, r->data[12]);
+	npending -= i + 1;
+	memmove(pending, pending + i + 1, npending * sizeof(pending[0]));
+	if (!npending)
+		t_idle_from = r->t;
+}
 
-	int count = 0;
-//	for (count = 0; count < 133; count++) {
-	while (offset <= info.st_size) {
-		rec_hdr = (pcaprec_hdr_t *)(base + offset);
-//		printf("total len: %d actual len: %d\n", rec_hdr->incl_len, rec_hdr->orig_len);
-		offset += sizeof(pcaprec_hdr_t);
+/* OUT data goes with the last CBW, IN data with the oldest read waiting */
+static void data(const struct rkpcap_rec *r)
+{
+	struct cmd *c = NULL;
+	int i;
 
-		usb_pkt_hdr = (PUSBPCAP_BUFFER_PACKET_HEADER)(base + offset);
-//		printf("stage: %ld\n", usb_pkt_hdr->stage);
+	if (!(r->ep & 0x80)) {
+		if (npending)
+			c = &pending[npending - 1];
+	} else {
+		for (i = 0; i < npending && !c; i++)
+			if ((pending[i].command & 0x80000000) &&
+			    !pending[i].data_done)
+				c = &pending[i];
+	}
+	if (!c)
+		return;
+	c->bytes += r->len;
+	if (!c->expect || c->bytes >= c->expect)
+		c->data_done = 1;
+}
 
-		if (usb_pkt_hdr->endpoint == 0x00 && usb_pkt_hdr->stage == 1) {
-			printf("control transfer: %d\n", usb_pkt_hdr->dataLength);
+static void bulk(const struct rkpcap_rec *r)
+{
+	if (r->transfer != RKPCAP_TRANSFER_BULK) {
+		if (r->transfer == RKPCAP_TRANSFER_CONTROL && r->done) {
+			ncontrol++;
+			control_bytes += r->length;
 		}
+		return;
+	}
+	if (r->error) {
+		nerrors++;
+		if (verbose)
+			printf("%12.6f transfer error on endpoint 0x%02x\n",
+			       r->t - t_first, r->ep);
+	}
+	/* the data of OUT is in the submission, of IN in the completion */
+	if (!r->len || r->done != !!(r->ep & 0x80))
+		return;
+
+	if (!(r->ep & 0x80) && r->len == 31 && !memcmp(r->data, "USBC", 4))
+		cbw(r);
+	else if ((r->ep & 0x80) && r->len == 13 &&
+		 !memcmp(r->data, "USBS", 4))
+		csw(r);
+	else
+		data(r);
 
-		if (usb_pkt_hdr->endpoint == 0x02 && usb_pkt_hdr->transfer == 0x03 && usb_pkt_hdr->dataLength > 31 && usb_pkt_hdr->dataLength <= 8448) {
-			printf("bus: %d device: %d endpoint: 0x%02x dataLength: %d\n", usb_pkt_hdr->bus, usb_pkt_hdr->device,
-					usb_pkt_hdr->endpoint, usb_pkt_hdr->dataLength);
+	/*
+	 * firmware.bin is a stream of WRITESECTOR payloads as sent by the
+	 * vendor tool, each one prefixed by its length (32 bit little endian).
+	 * fxload -f replays it.
+	 */
+	if (fw_file && r->ep == 0x02 && r->len > 31 && r->len <= 8448) {
+		uint8_t len_le[4] = { r->len, r->len >> 8, r->len >> 16,
+				      r->len >> 24 };
+		fw_count++;
+		fwrite(len_le, 1, 4, fw_file);
+		fwrite(r->data, 1, r->len, fw_file);
+	}
+}
 
-			fprintf(c_header_file, "\n\t/******************************** sector %d ********************************/\n\t", count++);
-			fprintf(c_header_file, "{\n\t\t");
+static void report(void)
+{
+	uint64_t bytes = 0;
+	double span = t_last - t_first;
+	int i;
 
-			fprintf(c_header_file, "%d,{\n\t\t", usb_pkt_hdr->dataLength);
+	printf("\n%-16s %8s %6s %12s %9s %9s %9s %8s\n", "command", "count",
+	       "errors", "bytes", "mean ms", "min ms", "max ms", "MiB/s");
+	for (i = 0; i < nstats; i++) {
+		struct cmdstat *st = &stats[i];
+		printf("%-16s %8llu %6llu %12llu %9.3f %9.3f %9.3f %8.2f\n",
+		       command_name(st->command), (unsigned long long)st->n,
+		       (unsigned long long)st->errors,
+		       (unsigned long long)st->bytes, st->sum / st->n * 1000,
+		       st->min * 1000, st->max * 1000,
+		       st->sum > 0 ? st->bytes / st->sum / 1048576 : 0.0);
+		bytes += st->bytes;
+	}
 
-//			fprintf(c_header_file, "{\n\t\t");
+	printf("\n%llu records over %.3f s\n", (unsigned long long)nrecords,
+	       span);
+	if (ncontrol)
+		printf("%llu control transfers, %llu bytes\n",
+		       (unsigned long long)ncontrol,
+		       (unsigned long long)control_bytes);
+	printf("idle: %llu gaps of %.1f ms or more, %.3f s in total",
+	       (unsigned long long)idle_n, GAP_REPORT * 1000, idle_sum);
+	if (idle_n)
+		printf(", longest %.1f ms at %.3f s", idle_max * 1000,
+		       idle_max_at);
+	printf("\nthroughput: %llu bytes in %.3f s, %.2f MiB/s\n",
+	       (unsigned long long)bytes, span,
+	       span > 0 ? bytes / span / 1048576 : 0.0);
+	if (nerrors || unmatched || unanswered || npending)
+		printf("%llu transfer errors, %llu CSWs without a command, "
+		       "%llu commands without a CSW\n",
+		       (unsigned long long)nerrors,
+		       (unsigned long long)unmatched,
+		       (unsigned long long)(unanswered + npending));
+}
 
-			int i;
-			for (i=0; i<usb_pkt_hdr->dataLength; i++) {
-				if (i % 16 == 0 && i != 0)
-					fprintf(c_header_file, "\n\t\t");
+int main(int argc, char *argv[])
+{
+	struct rkpcap_reader rd;
+	struct rkpcap_rec r;
+	const char *fw_path = "firmware.bin";
+	int opt, ret;
 
-				fprintf(c_header_file, "0x%02x,", *((uint8_t *)base + offset + i + usb_pkt_hdr->headerLen));
-			}
-			fseek(c_header_file, -1, SEEK_CUR);
-			fprintf(c_header_file, "}\n\t},");
-//			fprintf(c_header_file, "\n");
+	while ((opt = getopt(argc, argv, "vf:")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		case 'f':
+			fw_path = optarg;
+			break;
+		default:
+			goto usage;
 		}
-		offset += rec_hdr->incl_len;
+	}
+	if (optind != argc - 1) {
+usage:
+		fprintf(stderr, "usage: %s [-v] [-f firmware.bin] capture.pcap\n",
+			argv[0]);
+		return 1;
+	}
 
-//		printf("data offset: %d %d %d\n", sizeof(pcaprec_hdr_t), sizeof(*usb_pkt_hdr), offset);
+	if (rkpcap_reader_open(&rd, argv[optind]) < 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], rd.errmsg);
+		return -1;
 	}
+	printf("linktype: %u (%s), %s timestamps\n", rd.linktype,
+	       rd.linktype == RKPCAP_DLT_USBPCAP ? "USBPcap" : "usbmon",
+	       rd.nsec ? "nanosecond" : "microsecond");
 
-	fprintf(c_header_file, "{.len = -1}");
+	fw_file = fopen(fw_path, "wb");
+	if (!fw_file) {
+		perror(fw_path);
+		return -1;
+	}
+
+	while ((ret = rkpcap_next(&rd, &r)) > 0) {
+		if (t_first < 0)
+			t_first = r.t;
+		t_last = r.t;
+		nrecords++;
+		bulk(&r);
+	}
+	if (ret < 0)
+		fprintf(stderr, "%s: %s\n", argv[optind], rd.errmsg);
 
-//	fseek(c_header_file, -1, SEEK_CUR);
-	fprintf(c_header_file, "\n};");
+	report();
+	printf("%d records written to %s\n", fw_count, fw_path);
 
-	munmap(base, info.st_size);
-	close(fd);
+	fclose(fw_file);
+	rkpcap_reader_close(&rd);
 
 	return 0;
 }
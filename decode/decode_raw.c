@@ -0,0 +1,197 @@
+/*
+ * decode_raw - look into a raw NAND dump of rkflashtool rawdump
+ *
+ * The pages of a dump all have the same size (see rkraw.h), so a page is
+ * found by seeking to it, however large the dump is. Without options the
+ * geometry in the header is printed, and how many of the pages made it
+ * into the file.
+ *
+ * usage: decode_raw [-p page | -b block] [-x] [-i] dump
+ *
+ *   -p     print where a page is, whether it is erased, and its spare
+ *   -b     the same for every page of an erase block
+ *   -x     write the data of the page(s) to stdout instead, without spare
+ *   -i     index the whole dump: one line per page with its state and CRC
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../rkcrc.h"
+#include "../rkraw.h"
+
+static struct rkraw_header hdr;
+static uint32_t present;	/* pages in the file */
+static FILE *f;
+static uint8_t *page_buf;
+
+static int read_page(uint32_t page)
+{
+	if (page < hdr.first_page || page - hdr.first_page >= present)
+		return -1;
+	if (fseeko(f, rkraw_offset(&hdr, page), SEEK_SET) ||
+	    fread(page_buf, 1, hdr.page_bytes, f) != hdr.page_bytes)
+		return -1;
+	return 0;
+}
+
+static int erased(const uint8_t *p, size_t len)
+{
+	while (len--)
+		if (*p++ != 0xff)
+			return 0;
+	return 1;
+}
+
+/* 1 if all data bytes are 0xff, 2 if the spare bytes are too */
+static int page_state(void)
+{
+	int i, data = 1, spare = 1;
+
+	for (i = 0; i < hdr.page_sectors; i++) {
+		uint8_t *s = page_buf + i * (512 + RKRAW_SPARE);
+		data &= erased(s, 512);
+		spare &= erased(s + 512, RKRAW_SPARE);
+	}
+	return data + (data && spare);
+}
+
+static const char *state_name(int state)
+{
+	return state == 2 ? "erased" : state == 1 ? "empty" : "data";
+}
+
+static uint32_t data_crc(void)
+{
+	uint32_t crc = 0;
+	int i;
+
+	for (i = 0; i < hdr.page_sectors; i++)
+		crc = rkcrc32(crc, page_buf + i * (512 + RKRAW_SPARE), 512);
+	return crc;
+}
+
+static void show_page(uint32_t page, int extract)
+{
+	int i, k;
+
+	if (read_page(page) < 0) {
+		fprintf(stderr, "page 0x%x is not in the dump\n", page);
+		exit(1);
+	}
+	if (extract) {
+		for (i = 0; i < hdr.page_sectors; i++)
+			fwrite(page_buf + i * (512 + RKRAW_SPARE), 1, 512, stdout);
+		return;
+	}
+	printf("page 0x%x block 0x%x at 0x%llx: %s, crc 0x%08x\n", page,
+	       page / hdr.block_pages,
+	       (unsigned long long)rkraw_offset(&hdr, page),
+	       state_name(page_state()), data_crc());
+	for (i = 0; i < hdr.page_sectors; i++) {
+		uint8_t *s = page_buf + i * (512 + RKRAW_SPARE) + 512;
+		printf("  spare %2d:", i);
+		for (k = 0; k < RKRAW_SPARE; k++)
+			printf(" %02x", s[k]);
+		putchar('\n');
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long long page = -1, block = -1;
+	int opt, extract = 0, index = 0;
+	uint8_t head[RKRAW_HEADER_SIZE];
+	uint32_t p, first, n;
+	off_t size;
+
+	while ((opt = getopt(argc, argv, "p:b:xi")) != -1) {
+		switch (opt) {
+		case 'p':
+			page = strtoll(optarg, NULL, 0);
+			break;
+		case 'b':
+			block = strtoll(optarg, NULL, 0);
+			break;
+		case 'x':
+			extract = 1;
+			break;
+		case 'i':
+			index = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || (page >= 0 && block >= 0)) {
+usage:
+		fprintf(stderr, "usage: %s [-p page | -b block] [-x] [-i] dump\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (!(f = fopen(argv[optind], "rb"))) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fread(head, 1, sizeof(head), f) != sizeof(head))
+		memset(head, 0, sizeof(head));
+	memcpy(&hdr, head, sizeof(hdr));
+	if (memcmp(hdr.magic, RKRAW_MAGIC, sizeof(hdr.magic)) ||
+	    !hdr.page_sectors || !hdr.block_pages ||
+	    hdr.page_bytes != hdr.page_sectors * (512 + RKRAW_SPARE)) {
+		fprintf(stderr, "%s: not a raw dump\n", argv[optind]);
+		return 1;
+	}
+	if (!(page_buf = malloc(hdr.page_bytes))) {
+		perror("malloc");
+		return 1;
+	}
+	fseeko(f, 0, SEEK_END);
+	size = ftello(f);
+	present = size > hdr.header_size ?
+		  (size - hdr.header_size) / hdr.page_bytes : 0;
+	if (present > hdr.npages)
+		present = hdr.npages;
+
+	if (page >= 0) {
+		show_page(page, extract);
+		return 0;
+	}
+	if (block >= 0) {
+		first = block * hdr.block_pages;
+		for (p = first; p < first + hdr.block_pages; p++)
+			show_page(p, extract);
+		return 0;
+	}
+
+	printf("flash id         %02x %02x %02x %02x %02x\n", hdr.flash_id[0],
+	       hdr.flash_id[1], hdr.flash_id[2], hdr.flash_id[3],
+	       hdr.flash_id[4]);
+	printf("flash size       0x%08x sectors\n", hdr.flash_size);
+	printf("page             %u sectors, %u bytes with spare\n",
+	       hdr.page_sectors, hdr.page_bytes);
+	printf("block            %u pages\n", hdr.block_pages);
+	printf("ecc bits         %u\n", hdr.ecc_bits);
+	printf("manufacturer     %u, chip select %u, access time %u\n",
+	       hdr.manufacturer_id, hdr.chip_select, hdr.access_time);
+	printf("pages            0x%x from 0x%x, 0x%x in the file%s\n",
+	       hdr.npages, hdr.first_page, present,
+	       present < hdr.npages ? " (truncated)" : "");
+
+	if (index) {
+		for (n = 0; n < present; n++) {
+			p = hdr.first_page + n;
+			if (read_page(p) < 0)
+				break;
+			printf("0x%08x 0x%06x %-6s 0x%08x\n", p,
+			       p / hdr.block_pages, state_name(page_state()),
+			       data_crc());
+		}
+	}
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,405 @@
+/*
+ * replay_pcap - replay the Rockchip loader commands of a USB capture
+ *
+ * Takes the bulk transfers of a capture (USBPcap, usbmon or rkflashtool
+ * --trace, see decode_pcap), groups them into commands, each a CBW with
+ * its data phase and CSW, and sends them to the first Rockchip device
+ * found, either as fast as it takes them or with the pacing of the
+ * capture. Then it compares, per command, the latency (CBW to CSW) and
+ * the status with the capture, so that a protocol performance change can
+ * be reproduced and bisected without setting up the original scenario.
+ *
+ * Only commands known to just read from the device are replayed unless
+ * -w is given: writes, erases, resets, unknown commands and the like may
+ * change the board.
+ *
+ * usage: replay_pcap [-p] [-w] [-v] capture.pcap
+ *
+ *   -p     wait for the recorded time of each transfer
+ *   -w     replay commands that change the device as well
+ *   -v     print every command
+ *
+ * build: gcc -O2 -o replay_pcap replay_pcap.c -lusb-1.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../rkusb.h"
+#include "../rkpcap.h"
+
+#define MAX_OPEN	256	/* submitted transfers waiting for completion */
+#define MIN_TIMEOUT	5000	/* ms */
+
+struct xfer {
+	uint64_t id;
+	double t_sub, t_done;
+	uint8_t ep;
+	uint32_t length;	/* OUT: to send, IN: what came back */
+	uint8_t *data;		/* OUT only */
+	uint32_t crc;		/* of the IN data, if it was captured */
+	int have_crc;
+	int error;
+	int status;		/* if it is a CSW */
+};
+
+struct command {
+	uint32_t command, offset;
+	int first, n;		/* its transfers */
+	int csw;		/* index of the CSW transfer, -1 if none */
+	int rec_status, rep_status;
+	double rec_lat, rep_lat;
+	int skip, replayed, differs;
+};
+
+struct cmdstat {
+	uint32_t command;
+	int n;
+	double rec, rep;
+};
+
+static struct xfer *xfers;
+static int nxfers, axfers;
+static struct command *cmds;
+static int ncmds, acmds;
+
+static int pacing, writes, verbose;
+
+static uint8_t buf[1 << 20];
+
+static const char *command_name(uint32_t command)
+{
+	static char s[16];
+	const char *name = rkpcap_command_name(command);
+
+	if (name)
+		return name;
+	snprintf(s, sizeof(s), "0x%08x", command);
+	return s;
+}
+
+static void *grow(void *p, int n, int *alloc, size_t size)
+{
+	if (n < *alloc)
+		return p;
+	*alloc = *alloc ? *alloc * 2 : 1024;
+	if (!(p = realloc(p, *alloc * size))) {
+		perror("realloc");
+		exit(1);
+	}
+	return p;
+}
+
+/* The bulk transfers in the order they were submitted, grouped by CBW */
+static int load(const char *path)
+{
+	struct rkpcap_reader rd;
+	struct rkpcap_rec r;
+	int open[MAX_OPEN], nopen = 0, i, ret;
+
+	if (rkpcap_reader_open(&rd, path) < 0) {
+		fprintf(stderr, "%s: %s\n", path, rd.errmsg);
+		return -1;
+	}
+
+	while ((ret = rkpcap_next(&rd, &r)) > 0) {
+		struct xfer *x;
+
+		if (r.transfer != RKPCAP_TRANSFER_BULK)
+			continue;
+
+		if (r.done) {
+			for (i = 0; i < nopen; i++)
+				if (xfers[open[i]].id == r.id)
+					break;
+			if (i == nopen)
+				continue;
+			x = &xfers[open[i]];
+			memmove(open + i, open + i + 1,
+				(--nopen - i) * sizeof(open[0]));
+			x->t_done = r.t;
+			x->error = r.error;
+			if (x->ep & 0x80) {
+				x->length = r.length;
+				if (r.len == 13 && !memcmp(r.data, "USBS", 4))
+					x->status = r.data[12];
+				if (r.len == r.length) {
+					x->crc = rkcrc32(0, (uint8_t *)r.data,
+							 r.len);
+					x->have_crc = 1;
+				}
+			}
+			continue;
+		}
+
+		/* a CBW starts a command */
+		if (!(r.ep & 0x80) && r.len == 31 &&
+		    !memcmp(r.data, "USBC", 4)) {
+			struct command *c;
+
+			cmds = grow(cmds, ncmds, &acmds, sizeof(*cmds));
+			c = &cmds[ncmds++];
+			memset(c, 0, sizeof(*c));
+			c->command = rkpcap_get32(r.data + 12, 1);
+			c->offset = rkpcap_get32(r.data + 17, 1);
+			c->first = nxfers;
+			c->csw = -1;
+			c->skip = !writes && !rkpcap_command_readonly(c->command);
+		}
+		if (!ncmds)
+			continue;	/* before the first command */
+
+		xfers = grow(xfers, nxfers, &axfers, sizeof(*xfers));
+		x = &xfers[nxfers];
+		memset(x, 0, sizeof(*x));
+		x->id = r.id;
+		x->t_sub = r.t;
+		x->ep = r.ep;
+		if (!(r.ep & 0x80)) {
+			x->length = r.len;
+			if (!cmds[ncmds - 1].skip) {
+				if (!(x->data = malloc(r.len ? r.len : 1))) {
+					perror("malloc");
+					exit(1);
+				}
+				memcpy(x->data, r.data, r.len);
+			}
+		}
+		cmds[ncmds - 1].n++;
+		if (nopen == MAX_OPEN) {
+			fprintf(stderr, "more than %d transfers open\n",
+				MAX_OPEN);
+			return -1;
+		}
+		open[nopen++] = nxfers++;
+	}
+	if (ret < 0)
+		fprintf(stderr, "%s: %s\n", path, rd.errmsg);
+	rkpcap_reader_close(&rd);
+
+	/* the CSW is the last IN of 13 bytes, its status as recorded */
+	for (i = 0; i < ncmds; i++) {
+		struct command *c = &cmds[i];
+		int k;
+
+		for (k = c->first + c->n - 1; k >= c->first; k--)
+			if ((xfers[k].ep & 0x80) && xfers[k].length == 13)
+				break;
+		if (k < c->first)
+			continue;
+		c->csw = k;
+		c->rec_status = xfers[k].status;
+		c->rec_lat = xfers[k].t_done - xfers[c->first].t_sub;
+	}
+	return 0;
+}
+
+static libusb_device_handle *open_device(libusb_context *c)
+{
+	struct rkusb_dev *list = NULL;
+	libusb_device_handle *h = NULL;
+	int n;
+
+	if ((n = rkusb_scan(c, &list)) <= 0) {
+		fprintf(stderr, "no Rockchip device found\n");
+		if (!n)
+			rkusb_free_scan(list, 0);
+		return NULL;
+	}
+	if (libusb_open(list[0].dev, &h)) {
+		fprintf(stderr, "cannot open %s at %s\n", list[0].pid->name,
+			list[0].port);
+		h = NULL;
+	} else {
+		printf("replaying to %s at %s\n", list[0].pid->name,
+		       list[0].port);
+	}
+	rkusb_free_scan(list, n);
+	if (h) {
+		if (libusb_kernel_driver_active(h, 0) == 1)
+			libusb_detach_kernel_driver(h, 0);
+		if (libusb_claim_interface(h, 0) < 0) {
+			fprintf(stderr, "cannot claim interface\n");
+			libusb_close(h);
+			h = NULL;
+		}
+	}
+	return h;
+}
+
+static int replay(libusb_device_handle *h)
+{
+	double t0_rec = -1, t0 = rk_now(), t = 0;
+	int i, k, r, n, failed = 0;
+
+	for (i = 0; i < ncmds; i++) {
+		struct command *c = &cmds[i];
+
+		if (c->skip || c->csw < 0)
+			continue;
+		if (t0_rec < 0)
+			t0_rec = xfers[c->first].t_sub;
+
+		for (k = c->first; k < c->first + c->n; k++) {
+			struct xfer *x = &xfers[k];
+			unsigned int timeout = (x->t_done - x->t_sub) * 10000;
+
+			if (timeout < MIN_TIMEOUT)
+				timeout = MIN_TIMEOUT;
+			if (pacing) {
+				double wait = (x->t_sub - t0_rec) -
+					      (rk_now() - t0);
+				if (wait > 0)
+					usleep(wait * 1e6);
+			}
+			if (k == c->first)
+				t = rk_now();
+
+			if (x->ep & 0x80) {
+				if (x->length > sizeof(buf)) {
+					fprintf(stderr, "IN transfer of %u "
+						"bytes is too large\n",
+						x->length);
+					return -1;
+				}
+				r = libusb_bulk_transfer(h, x->ep, buf,
+							 x->length, &n,
+							 timeout);
+				if (!r && x->have_crc &&
+				    rkcrc32(0, buf, n) != x->crc)
+					c->differs = 1;
+			} else {
+				r = libusb_bulk_transfer(h, x->ep, x->data,
+							 x->length, &n,
+							 timeout);
+			}
+			if (r) {
+				fprintf(stderr, "%s at 0x%08x: %s\n",
+					command_name(c->command), c->offset,
+					libusb_error_name(r));
+				failed++;
+				break;
+			}
+			if (k == c->csw) {
+				c->rep_lat = rk_now() - t;
+				c->rep_status = n == 13 ? buf[12] : -1;
+				c->replayed = 1;
+			}
+		}
+
+		if (verbose && c->replayed)
+			printf("%-16s 0x%08x  recorded %9.3f ms  replayed "
+			       "%9.3f ms  %+7.1f%%%s%s\n",
+			       command_name(c->command), c->offset,
+			       c->rec_lat * 1000, c->rep_lat * 1000,
+			       c->rec_lat > 0 ? (c->rep_lat / c->rec_lat - 1) * 100
+					      : 0.0,
+			       c->rep_status != c->rec_status ?
+					" status differs" : "",
+			       c->differs ? " data differs" : "");
+		if (failed)
+			return -1;
+	}
+	return 0;
+}
+
+static void report(void)
+{
+	struct cmdstat st[64];
+	int nst = 0, i, j, skipped = 0, status = 0, differs = 0;
+	double rec = 0, rep = 0;
+
+	for (i = 0; i < ncmds; i++) {
+		struct command *c = &cmds[i];
+
+		if (c->skip) {
+			skipped++;
+			continue;
+		}
+		if (!c->replayed)
+			continue;
+		for (j = 0; j < nst; j++)
+			if (st[j].command == c->command)
+				break;
+		if (j == nst) {
+			if (nst == 64)
+				continue;
+			memset(&st[nst], 0, sizeof(st[0]));
+			st[nst++].command = c->command;
+		}
+		st[j].n++;
+		st[j].rec += c->rec_lat;
+		st[j].rep += c->rep_lat;
+		rec += c->rec_lat;
+		rep += c->rep_lat;
+		status += c->rep_status != c->rec_status;
+		differs += c->differs;
+	}
+
+	printf("\n%-16s %8s %12s %12s %8s\n", "command", "count",
+	       "recorded ms", "replayed ms", "change");
+	for (j = 0; j < nst; j++)
+		printf("%-16s %8d %12.3f %12.3f %+7.1f%%\n",
+		       command_name(st[j].command), st[j].n,
+		       st[j].rec / st[j].n * 1000, st[j].rep / st[j].n * 1000,
+		       st[j].rec > 0 ? (st[j].rep / st[j].rec - 1) * 100 : 0.0);
+	printf("\ntime in commands: recorded %.3f s, replayed %.3f s (%+.1f%%)\n",
+	       rec, rep, rec > 0 ? (rep / rec - 1) * 100 : 0.0);
+	if (skipped)
+		printf("%d commands that change the device skipped "
+		       "(use -w to replay them)\n", skipped);
+	if (status || differs)
+		printf("%d commands with another status, %d with other data\n",
+		       status, differs);
+}
+
+int main(int argc, char *argv[])
+{
+	libusb_context *c;
+	libusb_device_handle *h;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "pwv")) != -1) {
+		switch (opt) {
+		case 'p':
+			pacing = 1;
+			break;
+		case 'w':
+			writes = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1) {
+usage:
+		fprintf(stderr, "usage: %s [-p] [-w] [-v] capture.pcap\n",
+			argv[0]);
+		return 1;
+	}
+
+	if (load(argv[optind]) < 0)
+		return 1;
+	printf("%d commands in %d transfers\n", ncmds, nxfers);
+
+	if (libusb_init(&c)) {
+		fprintf(stderr, "cannot init libusb\n");
+		return 1;
+	}
+	if (!(h = open_device(c)))
+		return 1;
+
+	ret = replay(h);
+	report();
+
+	libusb_release_interface(h, 0);
+	libusb_close(h);
+	libusb_exit(c);
+	return ret < 0;
+}
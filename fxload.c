@@ -8,16 +8,14 @@
 #include <unistd.h>
 #include <libusb.h>
 #include <pthread.h>
-#include "bootrom.h"
-#include "decode/firmware.h"
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "version.h"
 #include "rkcrc.h"
 #include "rkflashtool.h"
-
-#define VENDOR	0x2207
-#define PRODUCT	0x300a
+#include "rkusb.h"
 
 #define RKFT_BLOCKSIZE      0x4000      /* must be multiple of 512 */
 #define RKFT_IDB_BLOCKSIZE  0x210
@@ -71,8 +69,7 @@
                         ((uint8_t*)a)[0] = (v>>24) & 0xff; \
                       } while(0)
 
-#define BLK_SIZE 4096
-#define DRAM_BLK_SIZE 8448
+#define DRAM_MAX_DEPTH 16
 
 //#define DEBUG
 
@@ -84,31 +81,68 @@
 	#define debug(format, ...)
 #endif
 
-int dram_idx;
-
-static volatile int do_exit = 0;
-static uint8_t cmd[31], res[13], buf[RKFT_BLOCKSIZE];
-static int stage, total;
-static int offset = 0;
-static int cmd_count = 0;
-static int ddr_fd, usb_fd;
-static int sector;
-static uint16_t crc16;
-static int load_state = 0;
-
-static void LIBUSB_CALL cmd_cb(struct libusb_transfer *xfr);
-static void LIBUSB_CALL res_cb(struct libusb_transfer *xfr);
-int stage1(struct libusb_device_handle **handle, struct libusb_device *dev);
-int stage2(struct libusb_device_handle **handle, struct libusb_device *dev);
-int hotplug_callback(struct libusb_context *ctx, struct libusb_device *dev,
-		libusb_hotplug_event event, void *user_data);
-static void LIBUSB_CALL dram_cb(struct libusb_transfer *xfr);
-static void LIBUSB_CALL test_device_cb(struct libusb_transfer *xfr);
-
-static void prepare_cmd(uint32_t command, uint32_t offset, uint16_t nsectors)
+/*
+ * DRAM firmware, loaded at runtime from a stream of length prefixed
+ * (32 bit little endian) WRITESECTOR payloads, see decode/decode_pcap.c.
+ * Record i goes to sector dram_sector[i], starting at 0x2000.
+ */
+static uint8_t *dram_map;
+static size_t dram_map_size;
+static const uint8_t **dram_data;
+static int *dram_len, *dram_sector;
+static int dram_count;
+static int dram_depth = 4;
+
+static struct rkimage ddr_img, usb_img;
+
+/* WRITESECTOR command/data/status sequences kept in flight */
+struct dram_slot {
+	struct rkdev *dev;
+	uint8_t cmd[31], csw[13];
+	struct libusb_transfer *xfr[3];
+	int idx, busy;
+};
+
+/*
+ * One board, identified by its physical location (bus and port path) so
+ * that it is recognised again when it re-enumerates between stages:
+ *
+ *   MASK ROM:  step 1 and 2, load ddr and usbplug images
+ *   usbplug:   step 3 to 5, test, erase, load dram firmware and reset
+ *   loader:    done
+ *
+ * All boards run concurrently from the same libusb event loop.
+ */
+struct rkdev {
+	struct rkdev *next;
+	char name[32];		/* bus-port.port... */
+
+	libusb_device *dev;
+	libusb_device_handle *handle;
+	int pending;		/* arrived, not yet handled by the main loop */
+	int gone;		/* unplugged, close handle once idle */
+	int failed;
+	int inflight;		/* transfers submitted and not completed */
+
+	const struct t_pid *pid;
+	int stage;		/* next stage to run when it shows up */
+	int sector;
+	uint8_t cmd[31], csw[13];
+
+	struct rkupload upload;
+	struct dram_slot dram_slot[DRAM_MAX_DEPTH];
+	int dram_next, dram_done;
+	double t_start, dram_start_time;
+};
+
+enum { STAGE_LOAD, STAGE_DRAM, STAGE_DONE };
+
+static struct rkdev *devices;
+static int boards_done, boards_failed;
+
+static void prepare_cmd(uint8_t *cmd, uint32_t command, uint32_t offset, uint16_t nsectors)
 {
     long int r = random();
-	int i;
 
     memset(cmd, 0 , 31);
     memcpy(cmd, "USBC", 4);
@@ -117,229 +151,482 @@ static void prepare_cmd(uint32_t command, uint32_t offset, uint16_t nsectors)
     if (offset)     SETBE32(cmd+17, offset);
     if (nsectors)   SETBE16(cmd+22, nsectors);
     if (command)    SETBE32(cmd+12, command);
+}
+
+static void dram_free(struct rkdev *d)
+{
+	int i, j;
+
+	for (i = 0; i < DRAM_MAX_DEPTH; i++)
+		for (j = 0; j < 3; j++) {
+			libusb_free_transfer(d->dram_slot[i].xfr[j]);
+			d->dram_slot[i].xfr[j] = NULL;
+		}
+}
+
+static void dev_close(struct rkdev *d)
+{
+	if (!d->handle || d->inflight)
+		return;
+	dram_free(d);
+	libusb_release_interface(d->handle, 0);
+	libusb_close(d->handle);
+	d->handle = NULL;
+}
 
-	/*
-	for (i=0; i<31; i++) {
-		printf("%02x", cmd[i]);
+static void dev_fail(struct rkdev *d, const char *what, int status)
+{
+	if (!d->failed) {
+		fprintf(stderr, "[%s] %s failed: %s\n", d->name, what, libusb_error_name(status));
+		boards_failed++;
 	}
-	printf("\n");
-	*/
+	d->failed = 1;
+	d->stage = STAGE_LOAD;
+	dev_close(d);
 }
 
-static void LIBUSB_CALL reset_cb(struct libusb_transfer *xfr)
+/* all bulk transfers of a board complete here first */
+static int xfr_done(struct libusb_transfer *xfr, struct rkdev *d, const char *what)
 {
+	d->inflight--;
 	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
-		fprintf(stderr, "res_cb, transfer status %d\n", xfr->status);
-		libusb_free_transfer(xfr);
-		exit(3);
+		dev_fail(d, what, rkusb_xfr_error(xfr->status));
+		return -1;
+	}
+	if (d->failed || d->gone) {
+		dev_close(d);
+		return -1;
 	}
+	return 0;
+}
+
+static int dev_submit(struct rkdev *d, struct libusb_transfer *xfr, const char *what)
+{
+	int rc;
 
-	prepare_cmd(RKFT_CMD_TESTUNITREADY, 0, 0);
-	libusb_fill_bulk_transfer(xfr, xfr->dev_handle, 0x02, cmd, 31, test_device_cb, NULL, 60*1000);
-	libusb_submit_transfer(xfr);
+	if ((rc = libusb_submit_transfer(xfr)) < 0) {
+		dev_fail(d, what, rc);
+		return rc;
+	}
+	d->inflight++;
+	return 0;
 }
 
-static void LIBUSB_CALL dram_cmd_cb(struct libusb_transfer *xfr)
+static void dev_bulk(struct rkdev *d, struct libusb_transfer *xfr, unsigned char ep,
+		uint8_t *data, int len, libusb_transfer_cb_fn cb, const char *what)
 {
-	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
-		fprintf(stderr, "res_cb, transfer status %d\n", xfr->status);
-		libusb_free_transfer(xfr);
-		exit(3);
+	libusb_fill_bulk_transfer(xfr, d->handle, ep, data, len, cb, d, 60*1000);
+	dev_submit(d, xfr, what);
+}
+
+static void board_done(struct rkdev *d)
+{
+	printf("[%s] %s ready, %.1f s\n", d->name, d->pid->name, rk_now() - d->t_start);
+	boards_done++;
+}
+
+static int load_dram_firmware(const char *path)
+{
+	struct stat st;
+	size_t off;
+	uint32_t len;
+	int fd, n, sector;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
 	}
+	dram_map_size = st.st_size;
+	dram_map = mmap(NULL, dram_map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (dram_map == MAP_FAILED)
+		return -1;
 
-	if (firmware[dram_idx].len == -1) {
-		printf("step 5, reset firmware.\n");
-		load_state = 5;
-		prepare_cmd(RKFT_CMD_RESETDEVICE, 0, 0);
+	/* count and check the records first */
+	for (n = 0, off = 0; off < dram_map_size; n++, off += 4 + len) {
+		if (dram_map_size - off < 4)
+			goto bad;
+		len = dram_map[off] | dram_map[off+1] << 8 |
+			dram_map[off+2] << 16 | (uint32_t)dram_map[off+3] << 24;
+		if (!len || len > dram_map_size - off - 4 || len / RKFT_IDB_BLOCKSIZE > 0xffff)
+			goto bad;
+	}
 
-		libusb_fill_bulk_transfer(xfr, xfr->dev_handle, 0x02, cmd, 31, reset_cb, NULL, 60*1000);
-		libusb_submit_transfer(xfr);
-	} else {
-		if ((sector & 0xff) == 0xf0)  {
+	dram_data = malloc(n * sizeof(*dram_data));
+	dram_len = malloc(n * sizeof(*dram_len));
+	dram_sector = malloc(n * sizeof(*dram_sector));
+	if (!dram_data || !dram_len || !dram_sector)
+		return -1;
+
+	sector = 0x2000;
+	for (dram_count = 0, off = 0; dram_count < n; dram_count++) {
+		dram_len[dram_count] = dram_map[off] | dram_map[off+1] << 8 |
+			dram_map[off+2] << 16 | (uint32_t)dram_map[off+3] << 24;
+		dram_data[dram_count] = dram_map + off + 4;
+		dram_sector[dram_count] = sector;
+		off += 4 + dram_len[dram_count];
+
+		if ((sector & 0xff) == 0xf0)
 			sector = ((sector >> 8) + 0x10) << 8;
-		} else {
+		else
 			sector += 0x10;
-		}
-		prepare_cmd(RKFT_CMD_WRITESECTOR, sector, firmware[dram_idx].len / 0x200);
-
-		debug("write sector cmd: 0x%04x offset: %d\n", sector, firmware[dram_idx].len / 0x200);
-		libusb_fill_bulk_transfer(xfr, xfr->dev_handle, 0x02, cmd, 31, dram_cb, NULL, 60*1000);
-		libusb_submit_transfer(xfr);
 	}
+
+	return 0;
+
+bad:
+	fprintf(stderr, "%s: bad record %d at offset %lu\n", path, n, (unsigned long)off);
+	return -1;
 }
 
-static void LIBUSB_CALL dram_cb(struct libusb_transfer *xfr)
+static void LIBUSB_CALL reset_cb(struct libusb_transfer *xfr)
 {
-	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
-		fprintf(stderr, "res_cb, transfer status %d\n", xfr->status);
-		libusb_free_transfer(xfr);
-		exit(3);
-	}
+	struct rkdev *d = xfr->user_data;
 
+	libusb_free_transfer(xfr);
+	d->inflight--;
+	dev_close(d);
+}
 
-	debug("write sector content %d len: %d data[0:3]: 0x%02x, 0x%02x, 0x%02x\n", 
-			dram_idx, firmware[dram_idx].len,
-			firmware[dram_idx].data[0],
-			firmware[dram_idx].data[1],
-			firmware[dram_idx].data[2]);
-	libusb_fill_bulk_transfer(xfr, xfr->dev_handle, 0x02, firmware[dram_idx].data, firmware[dram_idx].len, cmd_cb, NULL, 60*1000);
-	libusb_submit_transfer(xfr);
-	dram_idx++;
+static void dram_finish(struct rkdev *d)
+{
+	struct libusb_transfer *xfr;
+	double t = rk_now() - d->dram_start_time;
+
+	dram_free(d);
+	printf("[%s] dram: %d records in %.1f ms (%.1f KiB/s)\n", d->name, dram_count,
+			t * 1000, t > 0 ? dram_map_size / t / 1024 : 0);
+
+	/* the board re-enumerates with the new loader after this */
+	printf("[%s] step 5, reset firmware.\n", d->name);
+	d->stage = STAGE_DONE;
+	xfr = libusb_alloc_transfer(0);
+	prepare_cmd(d->cmd, RKFT_CMD_RESETDEVICE, 0, 0);
+	dev_bulk(d, xfr, 0x02, d->cmd, 31, reset_cb, "reset");
 }
 
-static void LIBUSB_CALL res_cb(struct libusb_transfer *xfr)
+/* on the first failure, so that the board does not wait out the others */
+static void dram_cancel(struct rkdev *d)
 {
-	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
-		fprintf(stderr, "res_cb, transfer status %d\n", xfr->status);
-		libusb_free_transfer(xfr);
-		exit(3);
+	int i, j;
+
+	for (i = 0; i < dram_depth; i++)
+		for (j = 0; j < 3; j++)
+			if (d->dram_slot[i].busy && d->dram_slot[i].xfr[j])
+				libusb_cancel_transfer(d->dram_slot[i].xfr[j]);
+}
+
+static void dram_submit(struct dram_slot *slot, int idx)
+{
+	struct rkdev *d = slot->dev;
+	int i;
+
+	slot->idx = idx;
+	prepare_cmd(slot->cmd, RKFT_CMD_WRITESECTOR, dram_sector[idx],
+			dram_len[idx] / RKFT_IDB_BLOCKSIZE);
+
+	debug("[%s] write sector cmd: 0x%04x len: %d\n", d->name, dram_sector[idx], dram_len[idx]);
+
+	/* order is kept per endpoint, so the command, data and status
+	 * phases of several sequences can be queued back to back */
+	slot->xfr[0]->buffer = slot->cmd;
+	slot->xfr[0]->length = 31;
+	slot->xfr[1]->buffer = (uint8_t *)dram_data[idx];
+	slot->xfr[1]->length = dram_len[idx];
+	slot->xfr[2]->buffer = slot->csw;
+	slot->xfr[2]->length = 13;
+
+	for (i = 0; i < 3; i++) {
+		if (dev_submit(d, slot->xfr[i], "dram") < 0) {
+			dram_cancel(d);
+			return;
+		}
+		slot->busy++;
 	}
+}
 
-	if (load_state == 4) {
-		sector++;
-		if (sector == 0x07) {
-			printf("step 4, load dram firmware.\n");
-			load_state = 5;
+static void LIBUSB_CALL dram_xfr_cb(struct libusb_transfer *xfr)
+{
+	struct dram_slot *slot = xfr->user_data;
+	struct rkdev *d = slot->dev;
 
-			sector = 0x2000;
-			dram_idx = 0;
-			prepare_cmd(RKFT_CMD_WRITESECTOR, sector, 0x10);
+	slot->busy--;
+	if (xfr_done(xfr, d, "dram") < 0) {
+		dram_cancel(d);
+		return;
+	}
+
+	if (xfr == slot->xfr[2]) {
+		if (memcmp(slot->csw, "USBS", 4) || slot->csw[12]) {
+			fprintf(stderr, "[%s] dram: record %d at sector 0x%04x failed\n",
+					d->name, slot->idx, dram_sector[slot->idx]);
+			dram_cancel(d);
+			dev_fail(d, "dram", LIBUSB_ERROR_IO);
+			return;
+		}
+		d->dram_done++;
+	}
 
-			debug("write sector cmd: 0x%04x offset: %d\n", sector, firmware[dram_idx].len / 0x200);
-			libusb_fill_bulk_transfer(xfr, xfr->dev_handle, 0x02, cmd, 31, dram_cb, NULL, 60*1000);
-			libusb_submit_transfer(xfr);
-		} else {
-			prepare_cmd(RKFT_CMD_ERASESECTORS, sector, 0x01);
+	/* all three phases done, the slot is free again */
+	if (slot->busy)
+		return;
+	if (d->dram_next < dram_count)
+		dram_submit(slot, d->dram_next++);
+	else if (d->dram_done == dram_count && !d->inflight)
+		dram_finish(d);
+}
 
-			libusb_fill_bulk_transfer(xfr, xfr->dev_handle, 0x02, cmd, 31, cmd_cb, NULL, 60*1000);
-			libusb_submit_transfer(xfr);
+static void dram_start(struct rkdev *d)
+{
+	int i, j;
+
+	printf("[%s] step 4, load dram firmware.\n", d->name);
+	d->dram_next = d->dram_done = 0;
+	d->dram_start_time = rk_now();
+
+	for (i = 0; i < dram_depth; i++) {
+		d->dram_slot[i].dev = d;
+		d->dram_slot[i].busy = 0;
+		for (j = 0; j < 3; j++) {
+			d->dram_slot[i].xfr[j] = libusb_alloc_transfer(0);
+			libusb_fill_bulk_transfer(d->dram_slot[i].xfr[j], d->handle, j < 2 ? 0x02 : 0x81,
+					NULL, 0, dram_xfr_cb, &d->dram_slot[i], 60*1000);
 		}
-	} else if (load_state == 6) {
-		printf("i don't knonw\n");
 	}
+
+	if (!dram_count) {
+		dram_finish(d);
+		return;
+	}
+	for (i = 0; i < dram_depth && d->dram_next < dram_count; i++)
+		dram_submit(&d->dram_slot[i], d->dram_next++);
 }
 
+/* step 4, erase sectors 2 to 6 one by one, then the dram firmware */
+static void LIBUSB_CALL erase_cb(struct libusb_transfer *xfr)
+{
+	struct rkdev *d = xfr->user_data;
+
+	if (xfr_done(xfr, d, "erase") < 0) {
+		libusb_free_transfer(xfr);
+		return;
+	}
+
+	if (xfr->endpoint == 0x02) {
+		dev_bulk(d, xfr, 0x81, d->csw, 13, erase_cb, "erase");
+		return;
+	}
+
+	if (++d->sector == 0x07) {
+		libusb_free_transfer(xfr);
+		dram_start(d);
+	} else {
+		prepare_cmd(d->cmd, RKFT_CMD_ERASESECTORS, d->sector, 0x01);
+		dev_bulk(d, xfr, 0x02, d->cmd, 31, erase_cb, "erase");
+	}
+}
 
 static void LIBUSB_CALL test_device_cb(struct libusb_transfer *xfr)
 {
-	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
-		fprintf(stderr, "cmd_cb, transfer status %d\n", xfr->status);
+	struct rkdev *d = xfr->user_data;
+
+	if (xfr_done(xfr, d, "test") < 0) {
 		libusb_free_transfer(xfr);
-		exit(3);
+		return;
 	}
 
-	if (load_state == 3) {
-		printf("step 4, erase sectors.\n");
+	printf("[%s] step 4, erase sectors.\n", d->name);
+	d->sector = 0x02;
+	prepare_cmd(d->cmd, RKFT_CMD_ERASESECTORS, d->sector, 0x01);
+	dev_bulk(d, xfr, 0x02, d->cmd, 31, erase_cb, "erase");
+}
+
+static void upload_report(struct rkdev *d, struct rkupload *u, const char *name)
+{
+	printf("[%s] %s: %lu bytes in %d transfers, prepare %.1f ms, transfer %.1f ms (%.1f KiB/s)\n",
+			d->name, name, (unsigned long)u->img->size + 2, u->img->nslots,
+			u->img->t_load * 1000, (u->t_end - u->t_start) * 1000,
+			rkupload_rate(u));
+}
 
-		load_state = 4;
-		sector = 0x02;
-		prepare_cmd(RKFT_CMD_ERASESECTORS, sector, 0x01);
+static void usb_done(struct rkupload *u)
+{
+	struct rkdev *d = u->user;
 
-		libusb_fill_bulk_transfer(xfr, xfr->dev_handle, 0x02, cmd, 31, cmd_cb, NULL, 60*1000);
-		libusb_submit_transfer(xfr);
-		/*
-	} else if (load_state == 5) {
-		printf("step 6");
-		do_exit = 1;
-		*/
+	d->inflight--;
+	if (u->status) {
+		dev_fail(d, "load usbplug image", u->status);
+		return;
 	}
+	upload_report(d, u, "usbplug");
+	d->stage = STAGE_DRAM;
+	dev_close(d);
 }
 
-static void LIBUSB_CALL cmd_cb(struct libusb_transfer *xfr)
+static void ddr_done(struct rkupload *u)
 {
-	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
-		fprintf(stderr, "cmd_cb, transfer status %d\n", xfr->status);
-		libusb_free_transfer(xfr);
-		exit(3);
+	struct rkdev *d = u->user;
+	int rc;
+
+	d->inflight--;
+	if (u->status) {
+		dev_fail(d, "load ddr image", u->status);
+		return;
 	}
+	upload_report(d, u, "ddr");
 
-	if (load_state == 4) {
-		libusb_fill_bulk_transfer(xfr, xfr->dev_handle, 0x81, cmd, 13, res_cb, NULL, 60*1000);
-	} else if (load_state == 5) {
-		debug("read sector reponse\n");
-		libusb_fill_bulk_transfer(xfr, xfr->dev_handle, 0x81, cmd, 13, dram_cmd_cb, NULL, 60*1000);
+	if (d->gone) {
+		dev_close(d);
+		return;
+	}
+	printf("[%s] step 2, load usbplug image.\n", d->name);
+	if ((rc = rkupload_start(&d->upload, d->handle, &usb_img, usb_done, d)) < 0) {
+		dev_fail(d, "load usbplug image", rc);
+		return;
 	}
-	libusb_submit_transfer(xfr);
+	d->inflight++;
 }
 
-static void LIBUSB_CALL ddr_xfr_cb(struct libusb_transfer *xfr)
+/* step 1 and 2, both images go out back to back from memory */
+static void stage_load(struct rkdev *d)
 {
-	int len;
+	int rc;
 
-	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
-		fprintf(stderr, "ddr_xfr_cb transfer status %d\n", xfr->status);
-		libusb_free_transfer(xfr);
-		exit(3);
+	printf("[%s] step 1, load ddr image.\n", d->name);
+	if ((rc = rkupload_start(&d->upload, d->handle, &ddr_img, ddr_done, d)) < 0) {
+		dev_fail(d, "load ddr image", rc);
+		return;
 	}
+	d->inflight++;
+}
 
-	if (load_state == 0) {
-		len = read(ddr_fd, buf + LIBUSB_CONTROL_SETUP_SIZE, BLK_SIZE);
-		if (len < 0) {
-			fprintf(stderr, "read ddr image failed\n");
-			exit(-1);
-		}
+/* step 3, test device, then erase and dram firmware */
+static void stage_dram(struct rkdev *d)
+{
+	struct libusb_transfer *xfr;
 
-		if (len == 0) {
-			printf("step 2, load usbplug image.\n");
+	printf("[%s] step 3, test device.\n", d->name);
+	xfr = libusb_alloc_transfer(0);
+	prepare_cmd(d->cmd, RKFT_CMD_TESTUNITREADY, 0, 0);
+	dev_bulk(d, xfr, 0x02, d->cmd, 31, test_device_cb, "test");
+}
 
-			lseek(usb_fd, 0, SEEK_SET);
+static struct rkdev *find_device(libusb_device *dev)
+{
+	struct rkdev *d;
+	char name[32];
+
+	rkusb_port_name(dev, name, sizeof(name));
+	for (d = devices; d; d = d->next)
+		if (!strcmp(d->name, name))
+			return d;
+
+	if (!(d = calloc(1, sizeof(*d))))
+		return NULL;
+	strcpy(d->name, name);
+	d->next = devices;
+	devices = d;
+	return d;
+}
 
-			len = read(usb_fd, buf + LIBUSB_CONTROL_SETUP_SIZE, BLK_SIZE);
-			if (len < 0) {
-				fprintf(stderr, "read ddr image failed\n");
-				exit(-1);
-			}
+/* Called from the main loop, not from the hotplug callback, as opening
+ * and claiming are synchronous.
+ */
+static void handle_arrival(struct rkdev *d)
+{
+	struct libusb_device_descriptor desc;
+	int rc;
 
-			load_state = 1;
-			crc16 = 0xffff;
-			crc16 = rkcrc16(crc16, buf + LIBUSB_CONTROL_SETUP_SIZE, len);
-			libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 0x0472, len);
-			libusb_submit_transfer(xfr);
-		} else {
-			crc16 = rkcrc16(crc16, buf + LIBUSB_CONTROL_SETUP_SIZE, len);
+	/* still busy with the previous instance, retry once that is done */
+	if (d->handle)
+		return;
+	d->pending = 0;
+
+	libusb_get_device_descriptor(d->dev, &desc);
+	d->pid = rkusb_find_pid(desc.idVendor, desc.idProduct);
+	d->gone = d->failed = 0;
+
+	if (desc.bcdUSB == 0x200) {
+		printf("[%s] %s in MASK ROM mode\n", d->name, d->pid->name);
+		d->stage = STAGE_LOAD;
+		d->t_start = rk_now();
+	} else if (d->stage != STAGE_DRAM) {
+		if (d->stage == STAGE_DONE)
+			board_done(d);
+		else
+			printf("[%s] %s loader, nothing to do\n", d->name, d->pid->name);
+		d->stage = STAGE_LOAD;
+		libusb_unref_device(d->dev);
+		return;
+	}
 
-			if (len != BLK_SIZE) {
-				buf[LIBUSB_CONTROL_SETUP_SIZE + len++] = crc16 >> 8;
-				buf[LIBUSB_CONTROL_SETUP_SIZE + len++] = crc16 & 0xff;
-			}
+	rc = libusb_open(d->dev, &d->handle);
+	libusb_unref_device(d->dev);
+	if (rc != LIBUSB_SUCCESS) {
+		d->handle = NULL;
+		dev_fail(d, "open", rc);
+		return;
+	}
 
-			libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 0x0471, len);
-			libusb_submit_transfer(xfr);
-		}
-	} else if (load_state == 1) {
-		len = read(usb_fd, buf + LIBUSB_CONTROL_SETUP_SIZE, BLK_SIZE);
-		if (len < 0) {
-			fprintf(stderr, "read usb image failed\n");
-			exit(-1);
-		}
+	/* We need to claim the first interface */
+	libusb_set_auto_detach_kernel_driver(d->handle, 1);
+	rc = libusb_claim_interface(d->handle, 0);
+	if (rc != LIBUSB_SUCCESS) {
+		libusb_close(d->handle);
+		d->handle = NULL;
+		dev_fail(d, "claim interface", rc);
+		return;
+	}
 
-		if (len > 0) {
-			crc16 = rkcrc16(crc16, buf + LIBUSB_CONTROL_SETUP_SIZE, len);
+	if (d->stage == STAGE_LOAD)
+		stage_load(d);
+	else
+		stage_dram(d);
+}
 
-			if (len != 4096) {
-				buf[LIBUSB_CONTROL_SETUP_SIZE + len++] = crc16 >> 8;
-				buf[LIBUSB_CONTROL_SETUP_SIZE + len++] = crc16 & 0xff;
-			}
+static int LIBUSB_CALL hotplug_callback(struct libusb_context *ctx, struct libusb_device *dev,
+		libusb_hotplug_event event, void *user_data)
+{
+	struct libusb_device_descriptor desc;
+	struct rkdev *d;
 
-			libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 0x0472, len);
-			libusb_submit_transfer(xfr);
-		}
+	libusb_get_device_descriptor(dev, &desc);
+	if (!rkusb_find_pid(desc.idVendor, desc.idProduct))
+		return 0;
+	if (!(d = find_device(dev)))
+		return 0;
+
+	if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event) {
+		debug("[%s] usb plugin event\n", d->name);
+		if (d->pending)
+			libusb_unref_device(d->dev);
+		d->dev = libusb_ref_device(dev);
+		d->pending = 1;
+	} else if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event) {
+		debug("[%s] usb remove\n", d->name);
+		d->gone = 1;
+		dev_close(d);
+	} else {
+		printf("Unhandled event %d\n", event);
 	}
-}
 
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
 	int status;
-	libusb_device_handle *device = NULL;
-	int opt, len;
-	char *ddr_file, *usb_file;
-	struct libusb_transfer *xfr;
+	int opt, fd;
+	char *ddr_file, *usb_file, *fw_file;
 	libusb_hotplug_callback_handle handle;
+	struct rkdev *d;
 	int rc;
 
-	ddr_file = usb_file = NULL;
-	while ((opt = getopt(argc, argv, "d:u:")) != -1) {
+	ddr_file = usb_file = fw_file = NULL;
+	while ((opt = getopt(argc, argv, "d:u:f:q:")) != -1) {
 		switch (opt) {
 			case 'd':
 				ddr_file = strdup(optarg);
@@ -347,27 +634,44 @@ int main(int argc, char **argv)
 			case 'u':
 				usb_file = strdup(optarg);
 				break;
+			case 'f':
+				fw_file = strdup(optarg);
+				break;
+			case 'q':
+				dram_depth = atoi(optarg);
+				if (dram_depth < 1)
+					dram_depth = 1;
+				if (dram_depth > DRAM_MAX_DEPTH)
+					dram_depth = DRAM_MAX_DEPTH;
+				break;
 			default:
-				printf("usage: fxload -d ddr_file -u usb_file\n");
+				printf("usage: fxload -d ddr_file -u usb_file -f firmware_file [-q depth]\n");
 		}
 	}
 
-	if (ddr_file == NULL || usb_file == NULL) {
-		printf("usage: fxload -d ddr_file -u usb_file\n");
+	if (ddr_file == NULL || usb_file == NULL || fw_file == NULL) {
+		printf("usage: fxload -d ddr_file -u usb_file -f firmware_file [-q depth]\n");
 		return 0;
 	}
 
-	ddr_fd = open(ddr_file, O_RDONLY);
-	if (ddr_fd < 0) {
+	if (load_dram_firmware(fw_file) < 0) {
+		fprintf(stderr, "can't load dram firmware\n");
+		return -1;
+	}
+
+	fd = open(ddr_file, O_RDONLY);
+	if (fd < 0 || rkimage_load(&ddr_img, fd, RKLOAD_DDR) < 0) {
 		fprintf(stderr, "can't open ddr image\n");
 		return -1;
 	}
+	close(fd);
 
-	usb_fd = open(usb_file, O_RDONLY);
-	if (usb_fd < 0) {
+	fd = open(usb_file, O_RDONLY);
+	if (fd < 0 || rkimage_load(&usb_img, fd, RKLOAD_USBPLUG) < 0) {
 		fprintf(stderr, "can't open usb image\n");
 		return -1;
 	}
+	close(fd);
 
 	/* open the device using libusb */
 	status = libusb_init(NULL);
@@ -377,10 +681,11 @@ int main(int argc, char **argv)
 	}
 	libusb_set_debug(NULL, 3);
 
-	stage = 0;
+	/* every Rockchip board on every port, including the ones already
+	 * plugged in (LIBUSB_HOTPLUG_ENUMERATE) */
 	rc = libusb_hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
-			LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0, VENDOR, PRODUCT,
-			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE, RKUSB_VENDOR,
+			LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL,
 			&handle);
 	if (LIBUSB_SUCCESS != rc) {
 		printf("Error creating a hotplug callback\n");
@@ -388,201 +693,17 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	device = libusb_open_device_with_vid_pid(NULL, VENDOR, PRODUCT);
-	if (device == NULL) {
-		debug("libusb_open() failed\n");
-		goto wait_plug;
-	}
-
-	/* We need to claim the first interface */
-	libusb_set_auto_detach_kernel_driver(device, 1);
-	status = libusb_claim_interface(device, 0);
-	if (status != LIBUSB_SUCCESS) {
-		fprintf(stderr, "libusb_claim_interface failed: %s\n", libusb_error_name(status));
-		goto wait_plug;
-	}
-
-	/* step 1, load ddr image */
-	xfr = libusb_alloc_transfer(0);
-
-	memset(buf, 0, RKFT_BLOCKSIZE);
-	lseek(ddr_fd, 0, SEEK_SET);
-
-	printf("step 1, load ddr image.\n");
-	stage++;
-	load_state = 0;
-	len = read(ddr_fd, buf + LIBUSB_CONTROL_SETUP_SIZE, BLK_SIZE);
-	crc16 = 0xffff;
-	crc16 = rkcrc16(crc16, buf + LIBUSB_CONTROL_SETUP_SIZE, len);
-
-	libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 0x0471, len);
-	libusb_fill_control_transfer(xfr, device, buf, ddr_xfr_cb, NULL, 60 * 1000);
-	libusb_submit_transfer(xfr);
-
-wait_plug:
-	while (!do_exit) {
-		int rc;
+	for (;;) {
 		rc = libusb_handle_events(NULL);
-		if (rc != LIBUSB_SUCCESS)
+		if (rc != LIBUSB_SUCCESS && rc != LIBUSB_ERROR_INTERRUPTED)
 			break;
+		for (d = devices; d; d = d->next)
+			if (d->pending)
+				handle_arrival(d);
 	}
 
-err:
+	printf("%d boards done, %d failed\n", boards_done, boards_failed);
 	libusb_hotplug_deregister_callback(NULL, handle);
 	libusb_exit(NULL);
 	return 0;
 }
-
-int hotplug_callback(struct libusb_context *ctx, struct libusb_device *dev,
-		libusb_hotplug_event event, void *user_data)
-{
-	static libusb_device_handle *handle = NULL;
-	struct libusb_device_descriptor desc;
-	int rc;
-
-	libusb_get_device_descriptor(dev, &desc);
-
-	if (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED == event) {
-		printf("usb plugin event\n");
-		if (stage % 3 == 0) {
-			printf("stage1\n");
-			rc = stage1(&handle, dev);
-			stage++;
-		} else if (stage % 3 == 1) {
-			printf("stage2\n");
-			rc = stage2(&handle, dev);
-			stage++;
-		} else if (stage % 3 == 2) {
-			printf("stage3\n");
-			stage++;
-		}
-	} else if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event) {
-		printf("usb remove\n");
-		if (handle) {
-			libusb_close(handle);
-			handle = NULL;
-		}
-	} else {
-		printf("Unhandled event %d\n", event);
-	}
-
-	return 0;
-}
-
-int stage1(struct libusb_device_handle **handle, struct libusb_device *dev)
-{
-	struct libusb_transfer *xfr;
-	libusb_device_handle *device = NULL;
-	int status, len;
-	int rc;
-
-	/* try to pick up missing parameters from known devices */
-	rc = libusb_open(dev, handle);
-	if (LIBUSB_SUCCESS != rc) {
-		printf("Could not open USB device\n");
-		return -1;
-	}
-
-	device = *handle;
-
-	/* We need to claim the first interface */
-	libusb_set_auto_detach_kernel_driver(device, 1);
-	status = libusb_claim_interface(device, 0);
-	if (status != LIBUSB_SUCCESS) {
-		fprintf(stderr, "libusb_claim_interface failed: %s\n", libusb_error_name(status));
-		goto err;
-	}
-
-	/* step 1, load ddr image */
-	xfr = libusb_alloc_transfer(0);
-
-	memset(buf, 0, RKFT_BLOCKSIZE);
-	lseek(ddr_fd, 0, SEEK_SET);
-
-	printf("step 1, load ddr image.\n");
-	load_state = 0;
-	len = read(ddr_fd, buf + LIBUSB_CONTROL_SETUP_SIZE, BLK_SIZE);
-	crc16 = 0xffff;
-	crc16 = rkcrc16(crc16, buf + LIBUSB_CONTROL_SETUP_SIZE, len);
-
-	libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 0x0471, len);
-	libusb_fill_control_transfer(xfr, device, buf, ddr_xfr_cb, NULL, 60 * 1000);
-	libusb_submit_transfer(xfr);
-
-err:
-	return 0;
-}
-
-int stage2(struct libusb_device_handle **handle, struct libusb_device *dev)
-{
-	struct libusb_transfer *xfr;
-	libusb_device_handle *device = NULL;
-	int status, len;
-	int rc;
-	int cfg;
-
-	/* try to pick up missing parameters from known devices */
-	rc = libusb_open(dev, handle);
-	if (LIBUSB_SUCCESS != rc) {
-		printf("Could not open USB device\n");
-		return -1;
-	}
-	
-	device = *handle;
-
-	/* We need to claim the first interface */
-	libusb_set_auto_detach_kernel_driver(device, 1);
-	status = libusb_claim_interface(device, 0);
-	if (status != LIBUSB_SUCCESS) {
-		fprintf(stderr, "libusb_claim_interface failed: %s\n", libusb_error_name(status));
-		goto err;
-	}
-
-	/* step 3, test device */
-	printf("step 3, test device.\n");
-	load_state = 3;
-	xfr = libusb_alloc_transfer(0);
-
-	prepare_cmd(RKFT_CMD_TESTUNITREADY, 0, 0);
-	libusb_fill_bulk_transfer(xfr, device, 0x02, cmd, 31, test_device_cb, NULL, 60*1000);
-	libusb_submit_transfer(xfr);
-
-err:
-	return 0;
-}
-
-int stage3(struct libusb_device_handle **handle, struct libusb_device *dev)
-{
-	struct libusb_transfer *xfr;
-	libusb_device_handle *device = NULL;
-	int status, len;
-	int rc;
-	int cfg;
-
-	/* try to pick up missing parameters from known devices */
-	rc = libusb_open(dev, handle);
-	if (LIBUSB_SUCCESS != rc) {
-		printf("Could not open USB device\n");
-		return -1;
-	}
-	
-	device = *handle;
-
-	/* We need to claim the first interface */
-	libusb_set_auto_detach_kernel_driver(device, 1);
-	status = libusb_claim_interface(device, 0);
-	if (status != LIBUSB_SUCCESS) {
-		fprintf(stderr, "libusb_claim_interface failed: %s\n", libusb_error_name(status));
-		goto err;
-	}
-
-	/* step 3, test device */
-	printf("step 3, test device.\n");
-	xfr = libusb_alloc_transfer(0);
-
-	prepare_cmd(RKFT_CMD_TESTUNITREADY, 0, 0);
-	libusb_fill_bulk_transfer(xfr, device, 0x02, cmd, 31, test_device_cb, NULL, 60*1000);
-	libusb_submit_transfer(xfr);
-err:
-	return 0;
-}
@@ -32,8 +32,17 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <sys/stat.h>
 #include <libusb-1.0/libusb.h>
 
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
 /* hack to set binary mode for stdin / stdout on Windows */
 #ifdef _WIN32
 #include <fcntl.h>
@@ -43,14 +52,19 @@ int _CRT_fmode = _O_BINARY;
 #include "version.h"
 #include "rkcrc.h"
 #include "rkflashtool.h"
+#include "rkusb.h"
+#include "rkzip.h"
+#include "rkpcap.h"
+#include "rkraw.h"
 
 #define RKFT_BLOCKSIZE      0x4000      /* must be multiple of 512 */
 #define RKFT_IDB_BLOCKSIZE  0x210
-#define RKFT_IDB_INCR       0x20
+#define RKFT_IDB_INCR       (RKFT_BUFSIZE / RKFT_IDB_BLOCKSIZE) /* 62, a queue buffer full */
 #define RKFT_MEM_INCR       0x80
+#define RKFT_MEM_BLOCKSIZE  0x8000      /* SDRAM bytes per command, the count is 16 bit */
 #define RKFT_OFF_INCR       (RKFT_BLOCKSIZE>>9)
+#define RKFT_BUFSIZE        RKFT_MEM_BLOCKSIZE  /* largest data phase */
 #define MAX_PARAM_LENGTH    (128*512-12) /* cf. MAX_LOADER_PARAM in rkloader */
-#define SDRAM_BASE_ADDRESS  0x60000000
 
 #define RKFT_CMD_TESTUNITREADY      0x80000600
 #define RKFT_CMD_READFLASHID        0x80000601
@@ -96,22 +110,6 @@ int _CRT_fmode = _O_BINARY;
                         ((uint8_t*)a)[0] = (v>>24) & 0xff; \
                       } while(0)
 
-static const struct t_pid {
-    const uint16_t pid;
-    const char name[8];
-} pidtab[] = {
-    { 0x281a, "RK2818" },
-    { 0x290a, "RK2918" },
-    { 0x292a, "RK2928" },
-    { 0x292c, "RK3026" },
-    { 0x300a, "RK3066" },
-    { 0x300b, "RK3168" },
-    { 0x310a, "RK3066B" },
-    { 0x310b, "RK3188" },
-    { 0x320a, "RK3288" },
-    { 0, "" },
-};
-
 typedef struct {
     uint32_t flash_size;
     uint16_t block_size;
@@ -135,19 +133,33 @@ static const char* const manufacturer[] = {   /* NAND Manufacturers */
 };
 #define MAX_NAND_ID (sizeof manufacturer / sizeof(char *))
 
-static uint8_t cmd[31], res[13], buf[RKFT_BLOCKSIZE];
+static uint8_t cmd[31], res[13], buf[RKFT_BUFSIZE];
 static libusb_context *c;
 static libusb_device_handle *h = NULL;
 static int tmp;
+static libusb_device *arrived[16];
+static int narrived;
+static double t_arrival;
+static const char *sel_port, *sel_serial;
 
 static const char *const strings[2] = { "info", "fatal" };
 
+static jmp_buf *fatal_jmp;  /* set while the daemon runs a job */
+static int bar_shown;       /* the cursor is behind a progress bar */
+
+static void events_fatal(const char *msg);
+
 static void info_and_fatal(const int s, const int cr, char *f, ...) {
+    char msg[4096];
     va_list ap;
     va_start(ap,f);
-    fprintf(stderr, "%srkflashtool: %s: ", cr ? "\r" : "", strings[s]);
-    vfprintf(stderr, f, ap);
+    vsnprintf(msg, sizeof(msg), f, ap);
     va_end(ap);
+    if (bar_shown && !cr) fputc('\n', stderr);
+    bar_shown = 0;
+    fprintf(stderr, "%srkflashtool: %s: %s", cr ? "\r" : "", strings[s], msg);
+    if (s) events_fatal(msg);
+    if (s && fatal_jmp) longjmp(*fatal_jmp, s);
     if (s) exit(s);
 }
 
@@ -163,10 +175,11 @@ static void usage(void) {
           "\trkflashtool v                   \tread chip version\n"
           "\trkflashtool n                   \tread NAND flash info\n"
           "\trkflashtool i offset nsectors >outfile \tread IDBlocks\n"
-//          "\trkflashtool j offset nsectors <infile  \twrite IDBlocks\n"
+          "\trkflashtool j offset nsectors <infile  \twrite IDBlocks\n"
           "\trkflashtool m offset nbytes   >outfile \tread SDRAM\n"
           "\trkflashtool M offset nbytes   <infile  \twrite SDRAM\n"
           "\trkflashtool B krnl_addr parm_addr      \texec SDRAM\n"
+          "\trkflashtool boot kernel parameter [initrd] \tload and run a kernel in SDRAM\n"
           "\trkflashtool r partname >outfile \tread flash partition\n"
           "\trkflashtool w partname <infile  \twrite flash partition\n"
           "\trkflashtool r offset nsectors >outfile \tread flash\n"
@@ -174,28 +187,448 @@ static void usage(void) {
 //          "\trkflashtool f                 >outfile \tread fuses\n"
 //          "\trkflashtool g                 <infile  \twrite fuses\n"
           "\trkflashtool p >file             \tfetch parameters\n"
+          "\trkflashtool list                \tlist partitions\n"
           "\trkflashtool P <file             \twrite parameters\n"
           "\trkflashtool e partname          \terase flash (fill with 0xff)\n"
           "\trkflashtool e offset nsectors   \terase flash (fill with 0xff)\n"
+          "\trkflashtool badblocks >outfile  \tscan the NAND for bad blocks\n"
+          "\trkflashtool rawdump [page npages] >outfile \tdump NAND pages with spare\n"
+          "options (before the command):\n"
+          "\t--wait[=seconds]                \twait for a device to show up\n"
+          "\t--port=bus-port[.port...]       \tuse the device at this USB port\n"
+          "\t--serial=serial                 \tuse the device with this serial number\n"
+          "\t--daemon=socket                 \tkeep devices open, serve jobs on socket\n"
+          "\t--socket=socket                 \trun the command in a daemon\n"
+          "\t--jobs=file                     \trun the steps in file, one per line\n"
+          "\t--compress=gzip|zstd[:level]    \tcompress the output of r\n"
+          "\t--threads=n                     \tnumber of (de)compression threads\n"
+          "\t--erase-skipped                 \tw: fill sparse image holes with 0xff\n"
+          "\t--journal=file [--resume]       \tr, w: record progress, continue from it\n"
+          "\t--skip-bad                      \trawdump: leave out blocks badblocks found bad\n"
+          "\t--verify                        \tP: read every copy back and check it\n"
+          "\t--queue=n                       \tr, w: keep n commands in flight (8)\n"
+          "\t--json[=file]                   \twrite progress and events as JSON lines\n"
+          "\t--trace=file                    \trecord the USB transfers as pcap\n"
+          "steps can also be given as: cmd [args] [<in] [>out] + cmd ...\n"
          );
 }
 
+/*
+ * Progress and events. Long jobs draw a progress bar on the terminal, at
+ * most every RKFT_BAR_INTERVAL. With --json each job also writes events,
+ * one JSON object per line: start, progress (every RKFT_JSON_INTERVAL),
+ * error, end and, after the end, a latency histogram for every command
+ * the job sent. Latency is from the CBW to the CSW, in power of two
+ * buckets of microseconds.
+ */
+
+#define RKFT_BAR_INTERVAL   0.1     /* s */
+#define RKFT_BAR_WIDTH      30
+#define RKFT_JSON_INTERVAL  1.0     /* s */
+#define RKFT_LAT_BUCKETS    24      /* up to 2^24 us */
+#define RKFT_LAT_COMMANDS   16
+
+static FILE *json;
+
+static struct {
+    char action;                    /* 0 while no job runs */
+    uint32_t offset;
+    uint64_t total, done;           /* bytes */
+    double t_start, t_bar, t_json;
+} prog;
+
+static struct {
+    uint32_t command, n;
+    uint32_t hist[RKFT_LAT_BUCKETS];
+    double sum, max;
+} lat[RKFT_LAT_COMMANDS];
+
+static void json_string(const char *s) {
+    fputc('"', json);
+    for (; *s && strcmp(s, "\n"); s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(json, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(json, "\\u%04x", *s);
+        else
+            fputc(*s, json);
+    }
+    fputc('"', json);
+}
+
+/* Writes {"t":...,"event":"name"<fields>}, fields start with a comma */
+static void json_event(const char *name, const char *f, ...) {
+    va_list ap;
+
+    if (!json) return;
+    fprintf(json, "{\"t\":%.3f,\"event\":\"%s\"", rk_now(), name);
+    if (prog.action)
+        fprintf(json, ",\"job\":\"%c\"", prog.action);
+    va_start(ap, f);
+    vfprintf(json, f, ap);
+    va_end(ap);
+    fputs("}\n", json);
+    fflush(json);
+}
+
+static void json_error(const char *type, const char *msg) {
+    if (!json) return;
+    fprintf(json, "{\"t\":%.3f,\"event\":\"error\",\"type\":\"%s\"",
+            rk_now(), type);
+    if (prog.action)
+        fprintf(json, ",\"job\":\"%c\"", prog.action);
+    fputs(",\"message\":", json);
+    json_string(msg);
+    fputs("}\n", json);
+    fflush(json);
+}
+
+static void lat_add(uint32_t command, double t) {
+    int i, b;
+    uint32_t us = t * 1e6;
+
+    for (i = 0; i < RKFT_LAT_COMMANDS; i++)
+        if (!lat[i].n || lat[i].command == command)
+            break;
+    if (i == RKFT_LAT_COMMANDS) return;
+    for (b = 0; b < RKFT_LAT_BUCKETS - 1 && us >> (b + 1); b++)
+        ;
+    lat[i].command = command;
+    lat[i].n++;
+    lat[i].hist[b]++;
+    lat[i].sum += t;
+    if (t > lat[i].max) lat[i].max = t;
+}
+
+static void progress_start(char action, uint32_t offset, uint64_t total) {
+    prog.action  = action;
+    prog.offset  = offset;
+    prog.total   = total;
+    prog.done    = 0;
+    prog.t_start = prog.t_json = rk_now();
+    prog.t_bar   = 0;
+    memset(lat, 0, sizeof(lat));
+    json_event("start", ",\"offset\":%u,\"bytes\":%llu", offset,
+               (unsigned long long)total);
+}
+
+static void progress_draw(const char *what, double now) {
+    double rate = prog.done / (now - prog.t_start + 1e-9);
+    int fill = prog.total ? prog.done * RKFT_BAR_WIDTH / prog.total : 0;
+    char bar[RKFT_BAR_WIDTH + 1];
+
+    if (fill > RKFT_BAR_WIDTH) fill = RKFT_BAR_WIDTH;
+    memset(bar, '#', fill);
+    memset(bar + fill, ' ', RKFT_BAR_WIDTH - fill);
+    bar[RKFT_BAR_WIDTH] = 0;
+    fprintf(stderr, "\rrkflashtool: info: %s [%s] %3d%% at 0x%08x %6.2f MB/s",
+            what, bar, prog.total ? (int)(prog.done * 100 / prog.total) : 0,
+            prog.offset, rate / 1e6);
+    if (rate > 0 && prog.done < prog.total)
+        fprintf(stderr, " ETA %d:%02d ",
+                (int)((prog.total - prog.done) / rate) / 60,
+                (int)((prog.total - prog.done) / rate) % 60);
+    else
+        fputs("          ", stderr);
+    bar_shown = 1;
+}
+
+/* Called after every block: offset is where the next one goes */
+static void progress(const char *what, uint32_t offset, uint64_t bytes) {
+    double now = rk_now(), rate;
+
+    prog.offset = offset;
+    prog.done  += bytes;
+    if (json == stderr || !isatty(2)) {
+        /* no bar then, it would only fill logs */
+    } else if (now - prog.t_bar >= RKFT_BAR_INTERVAL) {
+        prog.t_bar = now;
+        progress_draw(what, now);
+    }
+    if (json && now - prog.t_json >= RKFT_JSON_INTERVAL) {
+        prog.t_json = now;
+        rate = prog.done / (now - prog.t_start);
+        json_event("progress", ",\"offset\":%u,\"bytes\":%llu,\"total\":%llu,"
+                   "\"mbps\":%.2f,\"eta\":%.1f", offset,
+                   (unsigned long long)prog.done,
+                   (unsigned long long)prog.total, rate / 1e6,
+                   rate > 0 && prog.total > prog.done ?
+                       (prog.total - prog.done) / rate : 0.0);
+    }
+}
+
+/* The final state of the bar, it stays on the terminal */
+static void progress_done(const char *what) {
+    if (json != stderr && isatty(2))
+        progress_draw(what, rk_now());
+    else
+        fprintf(stderr, "rkflashtool: info: %s %llu bytes",
+                what, (unsigned long long)prog.done);
+    fprintf(stderr, "... Done!\n");
+    bar_shown = 0;
+}
+
+static void progress_end(const char *status) {
+    double t = rk_now() - prog.t_start;
+    int i, b, n;
+
+    if (!prog.action) return;
+    json_event("end", ",\"status\":\"%s\",\"bytes\":%llu,\"seconds\":%.3f,"
+               "\"mbps\":%.2f", status, (unsigned long long)prog.done, t,
+               t > 0 ? prog.done / t / 1e6 : 0.0);
+    for (i = 0; json && i < RKFT_LAT_COMMANDS && lat[i].n; i++) {
+        fprintf(json, "{\"t\":%.3f,\"event\":\"latency\",\"job\":\"%c\","
+                "\"command\":\"0x%08x\",\"count\":%u,\"mean_us\":%.0f,"
+                "\"max_us\":%.0f,\"buckets\":[", rk_now(), prog.action,
+                lat[i].command, lat[i].n, lat[i].sum / lat[i].n * 1e6,
+                lat[i].max * 1e6);
+        /* [upper bound in us, count] for the buckets that are used */
+        for (b = n = 0; b < RKFT_LAT_BUCKETS; b++)
+            if (lat[i].hist[b])
+                fprintf(json, "%s[%u,%u]", n++ ? "," : "", 2u << b,
+                        lat[i].hist[b]);
+        fputs("]}\n", json);
+    }
+    if (json) fflush(json);
+    prog.action = 0;
+}
+
+/* --json, or --json=- as well, is stderr */
+static void events_open(const char *path) {
+    if (!path) return;
+    if (!(json = strcmp(path, "-") ? fopen(path, "w") : stderr))
+        fatal("%s: %s\n", path, strerror(errno));
+}
+
+static void events_close(void) {
+    if (json && json != stderr) fclose(json);
+    json = NULL;
+}
+
+static void events_fatal(const char *msg) {
+    json_error("fatal", msg);
+    progress_end("failed");
+}
+
+/*
+ * Every command is a CBW, an optional data phase and a CSW, each with a
+ * timeout. Tags count up from a per-run start, so a CSW left over from an
+ * earlier command (or run) is never taken for the current one. recv_res()
+ * checks the CSW (signature, tag and status) and, if any phase failed,
+ * clears the endpoints and runs the whole command again after a short
+ * pause, up to RKFT_RETRIES times. A board that stopped answering gets
+ * only one more try, so it is given up on after its second timeout. The
+ * data for an OUT phase is still in buf then. Commands that move data or
+ * touch the flash get a timeout that grows with their count.
+ */
+
+#define RKFT_RETRIES        3
+#define RKFT_BACKOFF        10      /* ms, four times as long on each retry */
+#define RKFT_TIMEOUT        200     /* ms, unless listed in cmd_timeouts */
+#define RKFT_MAX_DEPTH      32      /* commands in flight, see queue_rw() */
+
+#define RKFT_ERR_CSW        1       /* xfer.error besides libusb's errors */
+#define RKFT_ERR_STATUS     2
+#define RKFT_ERR_TAG        3
+#define RKFT_ERR_RESIDUE    4
+
+static const struct {
+    uint32_t command;
+    unsigned int timeout;   /* ms */
+    unsigned int per;       /* ms more for every 1 << shift of the count */
+    unsigned int shift;
+} cmd_timeouts[] = {
+    { RKFT_CMD_READLBA,          500,  5,  0 },    /* sectors */
+    { RKFT_CMD_WRITELBA,        1000, 20,  0 },
+    { RKFT_CMD_READSECTOR,       500,  5,  0 },    /* IDB sectors */
+    { RKFT_CMD_WRITESECTOR,     1000, 20,  0 },
+    { RKFT_CMD_READSPARE,        500, 20,  0 },    /* raw pages */
+    { RKFT_CMD_READSDRAM,        500,  1, 10 },    /* bytes */
+    { RKFT_CMD_WRITESDRAM,       500,  1, 10 },
+    { RKFT_CMD_TESTBADBLOCK,    1000, 10,  0 },    /* blocks */
+    { RKFT_CMD_ERASESYSTEMDISK, 30000, 0,  0 },
+    { RKFT_CMD_LOWERFORMAT,     60000, 0,  0 },
+    { 0, 0, 0, 0 },
+};
+
+static unsigned int cmd_timeout(uint32_t command, uint32_t count) {
+    int i;
+
+    for (i = 0; cmd_timeouts[i].command; i++)
+        if (cmd_timeouts[i].command == command)
+            return cmd_timeouts[i].timeout +
+                   cmd_timeouts[i].per * ((count >> cmd_timeouts[i].shift) + 1);
+    return RKFT_TIMEOUT;
+}
+
+/* Commands whose data phase is all that their count says, no less */
+static int data_command(uint32_t command) {
+    switch (command) {
+    case RKFT_CMD_READLBA:
+    case RKFT_CMD_WRITELBA:
+    case RKFT_CMD_READSECTOR:
+    case RKFT_CMD_WRITESECTOR:
+    case RKFT_CMD_READSDRAM:
+    case RKFT_CMD_WRITESDRAM:
+    case RKFT_CMD_READSPARE:
+        return 1;
+    }
+    return 0;
+}
+
+static struct {
+    uint32_t command, offset;
+    int dir;                /* data phase: 0 none, 1 in, 2 out */
+    unsigned int len, timeout;
+    int error;              /* of the current try, 0 if all went well */
+    int once;               /* the device may be gone before the CSW */
+    int status;             /* from the CSW */
+    uint32_t residue;
+    double t;               /* the CBW went out */
+} xfer;
+
+static uint8_t drain[RKFT_BLOCKSIZE];
+static uint32_t next_tag;
+
+static uint32_t new_tag(void) {
+    if (!next_tag)
+        next_tag = (uint32_t)(rk_now() * 1000) ^ (uint32_t)getpid() << 16;
+    return next_tag++;
+}
+
+static const char *xfer_error(int e, int status, uint32_t residue) {
+    static char s[64];
+
+    if (e == RKFT_ERR_CSW)    return "bad status block";
+    if (e == RKFT_ERR_TAG)    return "status block of another command";
+    if (e == RKFT_ERR_RESIDUE)
+        snprintf(s, sizeof(s), "%u bytes of the data phase missing", residue);
+    else if (e == RKFT_ERR_STATUS)
+        snprintf(s, sizeof(s), "command failed (status %d, residue %u)",
+                 status, residue);
+    else
+        return libusb_error_name(e);
+    return s;
+}
+
+/* Checks a CSW against the tag of its command, status and residue too */
+static int check_csw(const uint8_t *csw, int len, const uint8_t *tag,
+                     uint32_t command, int *status, uint32_t *residue) {
+    if (len != 13 || memcmp(csw, "USBS", 4))
+        return RKFT_ERR_CSW;
+    if (memcmp(csw + 4, tag, 4))
+        return RKFT_ERR_TAG;
+    *status  = csw[12];
+    *residue = GET32LE(csw + 8);
+    if (*status)
+        return RKFT_ERR_STATUS;
+    return *residue && data_command(command) ? RKFT_ERR_RESIDUE : 0;
+}
+
+static const char *xfer_type(int e) {
+    switch (e) {
+    case RKFT_ERR_CSW:              return "csw";
+    case RKFT_ERR_TAG:              return "tag";
+    case RKFT_ERR_STATUS:           return "status";
+    case RKFT_ERR_RESIDUE:          return "residue";
+    case LIBUSB_ERROR_TIMEOUT:      return "timeout";
+    case LIBUSB_ERROR_PIPE:         return "stall";
+    case LIBUSB_ERROR_NO_DEVICE:    return "no_device";
+    default:                        return "usb";
+    }
+}
+
+/* what: retry, requeue, ignore or fatal */
+static void xfer_event(int e, uint32_t command, uint32_t offset, int status,
+                       uint32_t residue, const char *what) {
+    json_event("error", ",\"type\":\"%s\",\"command\":\"0x%08x\",\"offset\":%u,"
+               "\"status\":%d,\"residue\":%u,\"action\":\"%s\"", xfer_type(e),
+               command, offset, status, residue, what);
+}
+
+/*
+ * --trace records every transfer into a pcap file (USBPcap link type),
+ * through a ring buffer and a writer thread, see rkpcap.h. Transfers of
+ * the l and L uploads are control transfers and are not recorded.
+ */
+
+static struct rkpcap_writer trace;
+static uint64_t trace_irp;
+
+static uint32_t trace_status(int e) {
+    return !e                                ? 0 :
+           e == LIBUSB_ERROR_PIPE            ? RKPCAP_USBD_STALL :
+           e == LIBUSB_ERROR_TIMEOUT ||
+           e == LIBUSB_ERROR_INTERRUPTED     ? RKPCAP_USBD_CANCELED :
+                                               RKPCAP_USBD_ERROR;
+}
+
+static int bulk_transfer(unsigned char ep, uint8_t *data, int len, int *n,
+                         unsigned int timeout) {
+    uint64_t irp = ++trace_irp;
+    int r;
+
+    rkpcap_usb(&trace, irp, ep, 0, 0, data, ep & LIBUSB_ENDPOINT_IN ? 0 : len);
+    r = libusb_bulk_transfer(h, ep, data, len, n, timeout);
+    rkpcap_usb(&trace, irp, ep, 1, trace_status(r), data,
+               ep & LIBUSB_ENDPOINT_IN ? *n : 0);
+    return r;
+}
+
+static void trace_close(void) {
+    if (!trace.ring) return;
+    if (rkpcap_close(&trace) < 0)
+        info("trace: %s\n", strerror(errno));
+    info("trace: %llu records, %llu dropped\n",
+         (unsigned long long)trace.records, (unsigned long long)trace.drops);
+}
+
+static void trace_open(const char *path) {
+    static int registered;
+    libusb_device *dev = libusb_get_device(h);
+
+    if (!path) return;
+    if (rkpcap_open(&trace, path, libusb_get_bus_number(dev),
+                    libusb_get_device_address(dev)) < 0)
+        fatal("%s: %s\n", path, strerror(errno));
+    /* a trace of a run that ends in fatal() is the one that is needed */
+    if (!registered++) atexit(trace_close);
+}
+
+static void send_cbw(uint32_t command, uint32_t offset, uint32_t count) {
+    int r;
+
+    xfer.command = command;
+    xfer.offset  = offset;
+    xfer.dir     = 0;
+    xfer.error   = 0;
+    xfer.once    = command == RKFT_CMD_RESETDEVICE ||
+                   command == RKFT_CMD_EXECUTESDRAM;
+    xfer.timeout = cmd_timeout(command, count);
+
+    xfer.t = rk_now();
+    r = bulk_transfer(2|LIBUSB_ENDPOINT_OUT, cmd, sizeof(cmd), &tmp,
+                      xfer.timeout);
+    if (r || tmp != sizeof(cmd))
+        xfer.error = r ? r : LIBUSB_ERROR_IO;
+}
+
 static void send_exec(uint32_t krnl_addr, uint32_t parm_addr) {
-    long int r = random();
+    uint32_t r = new_tag();
 
     memset(cmd, 0 , 31);
     memcpy(cmd, "USBC", 4);
 
-    if (r)          SETBE32(cmd+4, r);
+                    SETBE32(cmd+4, r);
     if (krnl_addr)  SETBE32(cmd+17, krnl_addr);
     if (parm_addr)  SETBE32(cmd+22, parm_addr);
                     SETBE32(cmd+12, RKFT_CMD_EXECUTESDRAM);
 
-    libusb_bulk_transfer(h, 2|LIBUSB_ENDPOINT_OUT, cmd, sizeof(cmd), &tmp, 0);
+    send_cbw(RKFT_CMD_EXECUTESDRAM, krnl_addr, 0);
 }
 
 static void send_reset(uint8_t flag) {
-    long int r = random();
+    uint32_t r = new_tag();
 
     memset(cmd, 0 , 31);
     memcpy(cmd, "USBC", 4);
@@ -204,447 +637,1959 @@ static void send_reset(uint8_t flag) {
     SETBE32(cmd+12, RKFT_CMD_RESETDEVICE);
     cmd[16] = flag;
 
-    libusb_bulk_transfer(h, 2|LIBUSB_ENDPOINT_OUT, cmd, sizeof(cmd), &tmp, 0);
+    send_cbw(RKFT_CMD_RESETDEVICE, 0, 0);
 }
 
 static void send_cmd(uint32_t command, uint32_t offset, uint16_t nsectors) {
-    long int r = random();
+    uint32_t r = new_tag();
 
     memset(cmd, 0 , 31);
     memcpy(cmd, "USBC", 4);
 
-    if (r)          SETBE32(cmd+4, r);
+                    SETBE32(cmd+4, r);
     if (offset)     SETBE32(cmd+17, offset);
     if (nsectors)   SETBE16(cmd+22, nsectors);
     if (command)    SETBE32(cmd+12, command);
 
-    libusb_bulk_transfer(h, 2|LIBUSB_ENDPOINT_OUT, cmd, sizeof(cmd), &tmp, 0);
+    send_cbw(command, offset, nsectors);
 }
 
 static void send_buf(unsigned int s) {
-    libusb_bulk_transfer(h, 2|LIBUSB_ENDPOINT_OUT, buf, s, &tmp, 0);
+    int r;
+
+    xfer.dir = 2;
+    xfer.len = s;
+    if (xfer.error) return;
+    r = bulk_transfer(2|LIBUSB_ENDPOINT_OUT, buf, s, &tmp, xfer.timeout);
+    if (r || tmp != (int)s)
+        xfer.error = r ? r : LIBUSB_ERROR_IO;
 }
 
-static void recv_res(void) {
-    libusb_bulk_transfer(h, 1|LIBUSB_ENDPOINT_IN, res, sizeof(res), &tmp, 0);
+static void recv_buf(unsigned int s) {
+    int r;
+
+    xfer.dir = 1;
+    xfer.len = s;
+    if (xfer.error) return;
+    r = bulk_transfer(1|LIBUSB_ENDPOINT_IN, buf, s, &tmp, xfer.timeout);
+    if (r)
+        xfer.error = r;
+    else if (tmp != (int)s && data_command(xfer.command))
+        xfer.error = LIBUSB_ERROR_IO;
+    else if (tmp < (int)s)
+        /* replies to the info commands may be shorter, none of it stale */
+        memset(buf + tmp, 0, s - tmp);
 }
 
-static void recv_buf(unsigned int s) {
-    libusb_bulk_transfer(h, 1|LIBUSB_ENDPOINT_IN, buf, s, &tmp, 0);
+/* Gets both ends of the pipe back in step after a failed try */
+static void xfer_recover(void) {
+    int n;
+
+    libusb_clear_halt(h, 1|LIBUSB_ENDPOINT_IN);
+    libusb_clear_halt(h, 2|LIBUSB_ENDPOINT_OUT);
+    while (!bulk_transfer(1|LIBUSB_ENDPOINT_IN, drain, sizeof(drain), &n, 20))
+        ;
 }
 
-#define NEXT do { argc--;argv++; } while(0)
+static void recv_res(void) {
+    int try, r;
+
+    for (try = 0; ; try++) {
+        if (!xfer.error) {
+            r = bulk_transfer(1|LIBUSB_ENDPOINT_IN, res, sizeof(res), &tmp,
+                              xfer.timeout);
+            xfer.error = r ? r : check_csw(res, tmp, cmd + 4, xfer.command,
+                                           &xfer.status, &xfer.residue);
+            if (!xfer.error) {
+                lat_add(xfer.command, rk_now() - xfer.t);
+                return;
+            }
+        }
 
-int main(int argc, char **argv) {
+        if (xfer.once) {
+            xfer_event(xfer.error, xfer.command, xfer.offset, xfer.status,
+                       xfer.residue, "ignore");
+            info("no status for command 0x%08x: %s\n", xfer.command,
+                 xfer_error(xfer.error, xfer.status, xfer.residue));
+            return;
+        }
+        if (try == RKFT_RETRIES || xfer.error == LIBUSB_ERROR_NO_DEVICE ||
+                (try && xfer.error == LIBUSB_ERROR_TIMEOUT)) {
+            xfer_event(xfer.error, xfer.command, xfer.offset, xfer.status,
+                       xfer.residue, "fatal");
+            fatal("command 0x%08x at 0x%08x failed: %s\n", xfer.command,
+                  xfer.offset, xfer_error(xfer.error, xfer.status, xfer.residue));
+        }
+        xfer_event(xfer.error, xfer.command, xfer.offset, xfer.status,
+                   xfer.residue, "retry");
+        info("command 0x%08x at 0x%08x: %s, retrying\n", xfer.command,
+             xfer.offset, xfer_error(xfer.error, xfer.status, xfer.residue));
+
+        usleep((RKFT_BACKOFF << (2 * try)) * 1000);
+        xfer_recover();
+
+        /* same command with a new tag, then the same data phase */
+        SETBE32(cmd+4, new_tag());
+        r = xfer.dir;
+        send_cbw(xfer.command, xfer.offset, cmd[22] << 8 | cmd[23]);
+        if (r == 2) send_buf(xfer.len);
+        if (r == 1) recv_buf(xfer.len);
+    }
+}
+
+/* Detect connected RockChip device */
+
+static libusb_device_handle *open_device(libusb_device *dev, int retry) {
     struct libusb_device_descriptor desc;
-    const struct t_pid *ppid = pidtab;
-    ssize_t nr;
-    int offset = 0, size = 0;
-    uint16_t crc16;
-    uint8_t flag = 0;
-    char action;
-    char *partname = NULL;
+    libusb_device_handle *dh;
+    unsigned char serial[128];
+    int i, r;
+
+    /* a freshly enumerated device may not be accessible right away */
+    for (i = 0; ; i++) {
+        if ((r = libusb_open(dev, &dh)) == LIBUSB_SUCCESS) break;
+        if (!retry || i == 100 ||
+                (r != LIBUSB_ERROR_ACCESS && r != LIBUSB_ERROR_NOT_FOUND))
+            return NULL;
+        usleep(10*1000);
+    }
 
-    info("rkflashtool v%d.%d\n", RKFLASHTOOL_VERSION_MAJOR,
-                                 RKFLASHTOOL_VERSION_MINOR);
+    if (sel_serial) {
+        if (libusb_get_device_descriptor(dev, &desc) || !desc.iSerialNumber ||
+                libusb_get_string_descriptor_ascii(dh, desc.iSerialNumber,
+                                                   serial, sizeof(serial)) < 0 ||
+                strcmp((char *)serial, sel_serial)) {
+            libusb_close(dh);
+            return NULL;
+        }
+    }
+    return dh;
+}
 
-    NEXT; if (!argc) usage();
+static libusb_device_handle *open_first(int quiet) {
+    struct rkusb_dev *list = NULL;
+    libusb_device_handle *dh = NULL;
+    int i, n;
 
-    action = **argv; NEXT;
+    if ((n = rkusb_scan(c, &list)) < 0)
+        fatal("cannot list devices: %s\n", libusb_error_name(n));
 
-    switch(action) {
-    case 'b':
-        if (argc > 1) usage();
-        else if (argc == 1)
-            flag = strtoul(argv[0], NULL, 0);
-        break;
-    case 'l':
-    case 'L':
-        if (argc) usage();
-        break;
-    case 'e':
-    case 'r':
-    case 'w':
-        if (argc < 1 || argc > 2) usage();
-        if (argc == 1) {
-            partname = argv[0];
-        } else {
-            offset = strtoul(argv[0], NULL, 0);
-            size   = strtoul(argv[1], NULL, 0);
-        }
-        break;
-    case 'm':
-    case 'M':
-    case 'B':
-    case 'i':
-        if (argc != 2) usage();
-        offset = strtoul(argv[0], NULL, 0);
-        size   = strtoul(argv[1], NULL, 0);
-        break;
-    case 'n':
-    case 'v':
-    case 'p':
-    case 'P':
-        if (argc) usage();
-        offset = 0;
-        size   = 1024;
-        break;
-    default:
-        usage();
+    if (n > 1 && !quiet)
+        for (i = 0; i < n; i++)
+            info("found %s at %s%s\n", list[i].pid->name, list[i].port,
+                 list[i].maskrom ? " (MASK ROM MODE)" : "");
+
+    for (i = 0; i < n && !dh; i++) {
+        if (sel_port && strcmp(list[i].port, sel_port)) continue;
+        if ((dh = open_device(list[i].dev, 0)))
+            info("Detected %s at %s...\n", list[i].pid->name, list[i].port);
     }
 
-    /* Initialize libusb */
+    if (dh && n > 1 && !sel_port && !sel_serial && !quiet)
+        info("several devices found, select one with --port or --serial\n");
 
-    if (libusb_init(&c)) fatal("cannot init libusb\n");
+    rkusb_free_scan(list, n);
+    return dh;
+}
 
-    libusb_set_debug(c, 3);
+static int LIBUSB_CALL hotplug_cb(libusb_context *ctx, libusb_device *dev,
+                                  libusb_hotplug_event event, void *user_data) {
+    struct libusb_device_descriptor desc;
+    char port[32];
 
-    /* Detect connected RockChip device */
+    if (narrived == sizeof(arrived) / sizeof(*arrived) ||
+            libusb_get_device_descriptor(dev, &desc) ||
+            !rkusb_find_pid(desc.idVendor, desc.idProduct))
+        return 0;
 
-    while ( !h && ppid->pid) {
-        h = libusb_open_device_with_vid_pid(c, 0x2207, ppid->pid);
-        if (h) {
-            info("Detected %s...\n", ppid->name);
-            break;
-        }
-        ppid++;
+    if (sel_port) {
+        rkusb_port_name(dev, port, sizeof(port));
+        if (strcmp(port, sel_port)) return 0;
     }
-    if (!h) fatal("cannot open device\n");
 
-    /* Connect to device */
+    arrived[narrived++] = libusb_ref_device(dev);
+    t_arrival = rk_now();
+    return 0;
+}
 
-    if (libusb_kernel_driver_active(h, 0) == 1) {
-        info("kernel driver active\n");
-        if (!libusb_detach_kernel_driver(h, 0))
-            info("driver detached\n");
+/* Wait for a device, timeout in seconds (0 is forever). Without hotplug
+ * support in libusb (e.g. Windows) fall back to polling.
+ */
+static libusb_device_handle *wait_device(double timeout) {
+    libusb_hotplug_callback_handle cb;
+    struct libusb_device_descriptor desc;
+    libusb_device_handle *dh = NULL;
+    double deadline = rk_now() + timeout;
+    char port[32];
+    int r;
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        info("waiting for device (polling)...\n");
+        while (!(dh = open_first(1))) {
+            if (timeout > 0 && rk_now() > deadline) return NULL;
+            usleep(50*1000);
+        }
+        t_arrival = rk_now();
+        return dh;
     }
 
-    if (libusb_claim_interface(h, 0) < 0)
-        fatal("cannot claim interface\n");
-    info("interface claimed\n");
+    /* ENUMERATE also reports devices which are already there */
+    if (libusb_hotplug_register_callback(c, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+            LIBUSB_HOTPLUG_ENUMERATE, RKUSB_VENDOR, LIBUSB_HOTPLUG_MATCH_ANY,
+            LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, NULL, &cb) != LIBUSB_SUCCESS)
+        fatal("cannot register hotplug callback\n");
 
-    if (libusb_get_device_descriptor(libusb_get_device(h), &desc) != 0)
-        fatal("cannot get device descriptor\n");
+    if (!narrived) info("waiting for device...\n");
+    while (!dh) {
+        struct timeval tv = { 0, 100*1000 };
 
-    if (desc.bcdUSB == 0x200)
-        info("MASK ROM MODE\n");
+        /* opening is synchronous, so it is done here and not in the callback */
+        while (narrived && !dh) {
+            libusb_device *dev = arrived[--narrived];
 
-    switch(action) {
-    case 'l':
-        info("load DDR init\n");
-        crc16 = 0xffff;
-        while ((nr = read(0, buf, 4096)) == 4096) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1137, buf, nr, 0);
-        }
-        if (nr != -1) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            buf[nr++] = crc16 >> 8;
-            buf[nr++] = crc16 & 0xff;
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1137, buf, nr, 0);
-        }
-        goto exit;
-    case 'L':
-        info("load USB loader\n");
-        crc16 = 0xffff;
-        while ((nr = read(0, buf, 4096)) == 4096) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1138, buf, nr, 0);
-        }
-        if (nr != -1) {
-            crc16 = rkcrc16(crc16, buf, nr);
-            buf[nr++] = crc16 >> 8;
-            buf[nr++] = crc16 & 0xff;
-            libusb_control_transfer(h, LIBUSB_REQUEST_TYPE_VENDOR, 12, 0, 1138, buf, nr, 0);
+            if ((dh = open_device(dev, 1)) && !libusb_get_device_descriptor(dev, &desc)) {
+                rkusb_port_name(dev, port, sizeof(port));
+                info("Detected %s at %s...\n",
+                     rkusb_find_pid(desc.idVendor, desc.idProduct)->name, port);
+            }
+            libusb_unref_device(dev);
         }
-        goto exit;
-    }
+        if (dh) break;
 
-    /* Initialize bootloader interface */
+        if (timeout > 0 && rk_now() > deadline) break;
+        r = libusb_handle_events_timeout_completed(c, &tv, NULL);
+        if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) break;
+    }
 
-    send_cmd(RKFT_CMD_TESTUNITREADY, 0, 0);
-    recv_res();
-    usleep(20*1000);
+    libusb_hotplug_deregister_callback(c, cb);
+    while (narrived) libusb_unref_device(arrived[--narrived]);
+    return dh;
+}
 
-    /* Parse partition name */
-    if (partname) {
-        info("working with partition: %s\n", partname);
+static void report_arrival(void) {
+    if (t_arrival)
+        info("device arrival to first command: %.1f ms\n",
+             (rk_now() - t_arrival) * 1000);
+}
 
-        /* Read parameters */
-        offset = 0;
-        send_cmd(RKFT_CMD_READLBA, offset, RKFT_OFF_INCR);
-        recv_buf(RKFT_BLOCKSIZE);
-        recv_res();
+/*
+ * Parameter block and NAND size, read once per device session and shared
+ * by all steps of a batch.
+ */
 
-        /* Check parameter length */
-        uint32_t *p = (uint32_t*)buf+1;
-        size = *p;
-        if (size < 0 || size > MAX_PARAM_LENGTH)
-          fatal("Bad parameter length!\n");
+/* The parameters are kept in copies every RKFT_PARAM_STRIDE sectors */
+#define RKFT_PARAM_COPIES   8
+#define RKFT_PARAM_STRIDE   0x400
 
-        /* Search for mtdparts */
-        const char *param = (const char *)&buf[8];
-        const char *mtdparts = strstr(param, "mtdparts=");
-        if (!mtdparts) {
-            info("Error: 'mtdparts' not found in command line.\n");
-            goto exit;
-        }
+static uint8_t param_cache[RKFT_BLOCKSIZE];
+static int param_valid;
+static uint32_t flash_size;     /* 0 until read */
+static nand_info flash_info;    /* with flash_size */
 
-        /* Search for '(partition_name)' */
-        char partexp[256];
-        snprintf(partexp, 256, "(%s)", partname);
-        char *par = strstr(mtdparts, partexp);
-        if (!par) {
-            info("Error: Partition '%s' not found.\n", partname);
-            goto exit;
-        }
+static void param_copies(int writing, uint8_t *data, uint32_t nsectors);
 
-        /* Cut string by NULL-ing just before (partition_name) */
-        par[0] = '\0';
+/*
+ * Reads the first block of every parameter copy and keeps the first one
+ * whose length and CRC check out, reporting the others. Returns -1 if
+ * none does; the length in a block that was kept is then always inside
+ * it.
+ */
+static int read_params(void) {
+    static uint8_t copies[RKFT_PARAM_COPIES][RKFT_BLOCKSIZE];
+    int i, good = -1;
 
-        /* Search for '@' sign */
-        char *arob = strrchr(mtdparts, '@');
-        if (!arob) {
-            info("Error: Bad syntax in mtdparts.\n");
-            goto exit;
+    if (param_valid) {
+        memcpy(buf, param_cache, RKFT_BLOCKSIZE);
+        return 0;
+    }
+    param_copies(0, copies[0], RKFT_OFF_INCR);
+    for (i = 0; i < RKFT_PARAM_COPIES; i++) {
+        uint8_t *p = copies[i];
+        uint32_t size = GET32LE(p + 4);
+
+        if (memcmp(p, "PARM", 4) || size > RKFT_BLOCKSIZE - 12 ||
+                GET32LE(p + 8 + size) != rkcrc32(0, p + 8, size)) {
+            info("parameter copy %d at 0x%04x is corrupt\n", i,
+                 i * RKFT_PARAM_STRIDE);
+            continue;
         }
+        if (good < 0) good = i;
+    }
+    if (good < 0) {
+        info("none of the %d parameter copies is good\n", RKFT_PARAM_COPIES);
+        return -1;
+    }
+    if (good > 0)
+        info("using parameter copy %d\n", good);
+    memcpy(param_cache, copies[good], RKFT_BLOCKSIZE);
+    memcpy(buf, param_cache, RKFT_BLOCKSIZE);
+    param_valid = 1;
+    return 0;
+}
 
-        offset = strtoul(arob+1, NULL, 0);
-        info("found offset: %#010x\n", offset);
+static uint32_t read_flash_size(void) {
+    if (!flash_size) {
+        send_cmd(RKFT_CMD_READFLASHINFO, 0, 0);
+        recv_buf(512);
+        recv_res();
+        memcpy(&flash_info, buf, sizeof(flash_info));
+        flash_size = flash_info.flash_size;
+    }
+    return flash_size;
+}
 
-        /* Cut string by NULL-ing just before '@' sign */
-        arob[0] = '\0';
+/*
+ * Partition table
+ *
+ * The mtdparts= argument on the parameter CMDLINE is parsed into a table
+ * indexed by name. It is cached in memory for the session and on disk,
+ * keyed by the CRC of the parameter block, so it is only parsed once per
+ * parameter file.
+ *
+ * mtdparts=<id>:<size>[@<offset>](<name>)[ro],...,-@<offset>(<name>)
+ */
 
-        /* Search for '-' sign (if last partition) */
-        char *minus = strrchr(mtdparts, '-');
-        if (minus) {
+#define RKFT_MAX_PARTS      64
+#define RKFT_PART_HASH      128     /* power of two, > 2 * RKFT_MAX_PARTS */
 
-            /* Read size from NAND info */
-            send_cmd(RKFT_CMD_READFLASHINFO, 0, 0);
-            recv_buf(512);
-            recv_res();
+struct partition {
+    char name[32];
+    uint32_t offset, size;  /* in sectors */
+    int grow;               /* extends up to the end of the flash */
+};
 
-            nand_info *nand = (nand_info *) buf;
-            size = nand->flash_size - offset;
+struct parttab {
+    uint32_t crc;
+    int n;
+    struct partition part[RKFT_MAX_PARTS];
+    uint8_t hash[RKFT_PART_HASH];   /* index + 1, 0 is free */
+};
 
-            info("partition extends up to the end of NAND (size: 0x%08x).\n", size);
-            goto action;
-        }
+static struct parttab parttab;
 
-        /* Search for ',' sign */
-        char *comma = strrchr(mtdparts, ',');
-        if (comma) {
-            size = strtoul(comma+1, NULL, 0);
-            info("found size: %#010x\n", size);
-            goto action;
-        }
+static unsigned part_hash(const char *name) {
+    unsigned h = 2166136261u;
+    while (*name) h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h;
+}
 
-        /* Search for ':' sign (if first partition) */
-        char *colon = strrchr(mtdparts, ':');
-        if (colon) {
-            size = strtoul(colon+1, NULL, 0);
-            info("found size: %#010x\n", size);
-            goto action;
+static void parttab_index(struct parttab *t) {
+    int i;
+    unsigned k;
+
+    memset(t->hash, 0, sizeof(t->hash));
+    for (i = 0; i < t->n; i++) {
+        k = part_hash(t->part[i].name);
+        while (t->hash[k & (RKFT_PART_HASH-1)]) {
+            /* the first of several partitions with the same name wins */
+            if (!strcmp(t->part[t->hash[k & (RKFT_PART_HASH-1)] - 1].name,
+                        t->part[i].name))
+                break;
+            k++;
         }
-
-        /* Error: size not found! */
-        info("Error: Bad syntax for partition size.\n");
-        goto exit;
+        if (!t->hash[k & (RKFT_PART_HASH-1)])
+            t->hash[k & (RKFT_PART_HASH-1)] = i + 1;
     }
+}
 
-action:
-    /* Check and execute command */
+static struct partition *find_partition(const char *name) {
+    unsigned k = part_hash(name);
+    int i;
 
-    switch(action) {
-    case 'b':   /* Reboot device */
-        info("rebooting device...\n");
-		printf("flag: %d\n", flag);
-        send_reset(flag);
-        recv_res();
-        break;
-    case 'r':   /* Read FLASH */
-        while (size > 0) {
-            infocr("reading flash memory at offset 0x%08x", offset);
+    while ((i = parttab.hash[k++ & (RKFT_PART_HASH-1)]))
+        if (!strcmp(parttab.part[i-1].name, name))
+            return &parttab.part[i-1];
+    return NULL;
+}
 
-            send_cmd(RKFT_CMD_READLBA, offset, RKFT_OFF_INCR);
-            recv_buf(RKFT_BLOCKSIZE);
-            recv_res();
+/* Returns 0, -1 if there is no mtdparts= or -2 on a syntax error */
+static int parse_mtdparts(struct parttab *t, const char *param) {
+    const char *p = strstr(param, "mtdparts="), *q;
+    uint32_t next = 0;
+    char *end;
 
-            if (write(1, buf, RKFT_BLOCKSIZE) <= 0)
-                fatal("Write error! Disk full?\n");
+    t->n = 0;
+    if (!p) return -1;
+    if (!(p = strchr(p, ':'))) return -2;
+    p++;
 
-            offset += RKFT_OFF_INCR;
-            size   -= RKFT_OFF_INCR;
-        }
-        fprintf(stderr, "... Done!\n");
-        break;
-    case 'w':   /* Write FLASH */
-        while (size > 0) {
-            infocr("writing flash memory at offset 0x%08x", offset);
+    for (;;) {
+        struct partition *part = &t->part[t->n];
 
-            if (read(0, buf, RKFT_BLOCKSIZE) <= 0) {
-                fprintf(stderr, "... Done!\n");
-                info("premature end-of-file reached.\n");
-                goto exit;
-            }
+        if (t->n == RKFT_MAX_PARTS) return -2;
+        memset(part, 0, sizeof(*part));
 
-            send_cmd(RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR);
-            send_buf(RKFT_BLOCKSIZE);
-            recv_res();
+        if (*p == '-') {
+            part->grow = 1;
+            p++;
+        } else {
+            part->size = strtoul(p, &end, 0);
+            if (end == p) return -2;
+            p = end;
+        }
 
-            offset += RKFT_OFF_INCR;
-            size   -= RKFT_OFF_INCR;
+        if (*p == '@') {
+            part->offset = strtoul(++p, &end, 0);
+            if (end == p) return -2;
+            p = end;
+        } else {
+            part->offset = next;
         }
-        fprintf(stderr, "... Done!\n");
-        break;
-    case 'p':   /* Retreive parameters */
-        {
-            uint32_t *p = (uint32_t*)buf+1;
 
-            info("reading parameters at offset 0x%08x\n", offset);
+        if (*p == '(') {
+            if (!(q = strchr(p, ')')) || q - p - 1 >= (int)sizeof(part->name))
+                return -2;
+            memcpy(part->name, p + 1, q - p - 1);
+            p = q + 1;
+        }
+        while (!strncmp(p, "ro", 2) || !strncmp(p, "lk", 2)) p += 2;
 
-            send_cmd(RKFT_CMD_READLBA, offset, RKFT_OFF_INCR);
-            recv_buf(RKFT_BLOCKSIZE);
-            recv_res();
+        next = part->offset + part->size;
+        t->n++;
 
-            /* Check size */
-            size = *p;
-            info("size:  0x%08x\n", size);
-            if (size < 0 || size > MAX_PARAM_LENGTH)
-                fatal("Bad parameter length!\n");
+        if (*p != ',') break;
+        if (part->grow) return -2;  /* only the last one can grow */
+        p++;
+    }
 
-            /* Check CRC */
-            uint32_t crc_buf = *(uint32_t *)(buf + 8 + size),
-                     crc = 0;
-            crc = rkcrc32(crc, buf + 8, size);
-            if (crc_buf != crc)
-              fatal("bad CRC! (%#x, should be %#x)\n", crc_buf, crc);
+    if (*p && !strchr("; \t\r\n", *p)) return -2;
+    parttab_index(t);
+    return 0;
+}
 
-            if (write(1, &buf[8], size) <= 0)
-                fatal("Write error! Disk full?\n");
+#ifndef _WIN32
+/* $XDG_CACHE_HOME/rkflashtool/name, or in ~/.cache */
+static char *cache_path(const char *name, int create) {
+    static char path[4096];
+    const char *dir = getenv("XDG_CACHE_HOME"), *sub = "";
+
+    if (!dir || !*dir) {
+        if (!(dir = getenv("HOME"))) return NULL;
+        sub = "/.cache";
+    }
+    if (create) {
+        snprintf(path, sizeof(path), "%s%s", dir, sub);
+        mkdir(path, 0777);
+        snprintf(path, sizeof(path), "%s%s/rkflashtool", dir, sub);
+        mkdir(path, 0777);
+    }
+    snprintf(path, sizeof(path), "%s%s/rkflashtool/%s", dir, sub, name);
+    return path;
+}
+
+static char *parttab_path(uint32_t crc, int create) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "mtdparts-%08x", crc);
+    return cache_path(name, create);
+}
+
+static int parttab_load(struct parttab *t, uint32_t crc) {
+    char *path = parttab_path(crc, 0), line[128];
+    struct partition *part;
+    FILE *f;
+
+    if (!path || !(f = fopen(path, "r"))) return -1;
+    for (t->n = 0; t->n < RKFT_MAX_PARTS && fgets(line, sizeof(line), f); ) {
+        part = &t->part[t->n];
+        memset(part, 0, sizeof(*part));
+        if (sscanf(line, "%x %x %d %31[^\n]", &part->offset, &part->size,
+                   &part->grow, part->name) < 3)
+            break;
+        t->n++;
+    }
+    fclose(f);
+    t->crc = crc;
+    parttab_index(t);
+    return t->n ? 0 : -1;
+}
+
+static void parttab_save(const struct parttab *t) {
+    char *path = parttab_path(t->crc, 1);
+    FILE *f;
+    int i;
+
+    if (!path || !(f = fopen(path, "w"))) return;
+    for (i = 0; i < t->n; i++)
+        fprintf(f, "%08x %08x %d %s\n", t->part[i].offset, t->part[i].size,
+                t->part[i].grow, t->part[i].name);
+    fclose(f);
+}
+#else
+static int parttab_load(struct parttab *t, uint32_t crc) { return -1; }
+static void parttab_save(const struct parttab *t) { }
+#endif
+
+/* Returns 0, or -1 after telling why there is no usable table */
+static int read_parttab(void) {
+    static char param[MAX_PARAM_LENGTH + 1];
+    uint32_t size, crc;
+    int r;
+
+    if (read_params() < 0)
+        return -1;
+    size = GET32LE(buf + 4);
+    crc = rkcrc32(0, buf + 8, size);
+
+    if (parttab.n && parttab.crc == crc) return 0;
+    if (!parttab_load(&parttab, crc)) return 0;
+
+    memcpy(param, buf + 8, size);
+    param[size] = 0;
+    if ((r = parse_mtdparts(&parttab, param)) < 0) {
+        parttab.n = 0;
+        if (r == -1)
+            info("Error: 'mtdparts' not found in command line.\n");
+        else
+            info("Error: Bad syntax in mtdparts.\n");
+        return -1;
+    }
+    parttab.crc = crc;
+    parttab_save(&parttab);
+    return 0;
+}
+
+#define NEXT do { argc--;argv++; } while(0)
+
+struct job {
+    char action;
+    int offset, size;
+    uint8_t flag;
+    char *partname;
+    struct rkimage image;
+    uint8_t *boot[3];       /* boot: signed kernel, parameter file, initrd */
+    uint32_t boot_len[3];
+    uint8_t *tmp[2];        /* buffers of run_job, so fatal() leaks none */
+};
+
+/* Options, shared by all ways of running */
+
+static double wait = -1;
+static const char *daemon_path, *socket_path, *jobs_path;
+static int zip_method, zip_level, zip_threads;
+static int erase_skipped;
+static const char *journal_path;
+static int resume;
+static int depth = 8;           /* commands in flight for r and w */
+static int skip_bad;
+static int verify;
+static const char *json_path;
+static const char *trace_path;
+static struct rkzip_writer zip;
+static struct rkzip_reader unzip;
+
+static void parse_options(int *pargc, char ***pargv) {
+    int argc = *pargc;
+    char **argv = *pargv;
+
+    while (argc && !strncmp(*argv, "--", 2)) {
+        if (!strcmp(*argv, "--wait"))
+            wait = 0;
+        else if (!strncmp(*argv, "--wait=", 7))
+            wait = strtod(*argv + 7, NULL);
+        else if (!strncmp(*argv, "--port=", 7))
+            sel_port = *argv + 7;
+        else if (!strncmp(*argv, "--serial=", 9))
+            sel_serial = *argv + 9;
+        else if (!strncmp(*argv, "--daemon=", 9))
+            daemon_path = *argv + 9;
+        else if (!strncmp(*argv, "--socket=", 9))
+            socket_path = *argv + 9;
+        else if (!strncmp(*argv, "--jobs=", 7))
+            jobs_path = *argv + 7;
+        else if (!strncmp(*argv, "--compress=", 11)) {
+            if ((zip_method = rkzip_method(*argv + 11, &zip_level)) < 0)
+                fatal("unknown compression: %s\n", *argv + 11);
+        } else if (!strncmp(*argv, "--threads=", 10))
+            zip_threads = strtoul(*argv + 10, NULL, 0);
+        else if (!strcmp(*argv, "--erase-skipped"))
+            erase_skipped = 1;
+        else if (!strncmp(*argv, "--journal=", 10))
+            journal_path = *argv + 10;
+        else if (!strcmp(*argv, "--resume"))
+            resume = 1;
+        else if (!strcmp(*argv, "--json"))
+            json_path = "-";
+        else if (!strncmp(*argv, "--json=", 7))
+            json_path = *argv + 7;
+        else if (!strncmp(*argv, "--trace=", 8))
+            trace_path = *argv + 8;
+        else if (!strcmp(*argv, "--skip-bad"))
+            skip_bad = 1;
+        else if (!strcmp(*argv, "--verify"))
+            verify = 1;
+        else if (!strncmp(*argv, "--queue=", 8)) {
+            depth = strtoul(*argv + 8, NULL, 0);
+            if (depth < 1 || depth > RKFT_MAX_DEPTH)
+                fatal("--queue takes 1 to %d commands\n", RKFT_MAX_DEPTH);
         }
+        else
+            usage();
+        NEXT;
+    }
+
+    *pargc = argc;
+    *pargv = argv;
+}
+
+/*
+ * boot: the kernel, parameter file and initrd are loaded into SDRAM at
+ * these offsets from its base, the kernel and parameters with a KRNL or
+ * PARM header and CRC, as rkcrc -k and -p write them. The initrd is
+ * passed to the kernel as initrd= on the CMDLINE of the parameters.
+ */
+
+#define RKFT_BOOT_KERNEL    0x408000
+#define RKFT_BOOT_PARM      0x88000
+#define RKFT_BOOT_INITRD    0x2000000
+
+/* tag + length + data + CRC, or the data as it is if it is signed already */
+static uint8_t *sign_image(const char *tag, uint8_t *data, uint32_t *len) {
+    uint8_t *p;
+
+    if (*len >= 12 && !memcmp(data, tag, 4) && GET32LE(data + 4) == *len - 12)
+        return data;
+    if (!(p = malloc(*len + 12)))
+        fatal("out of memory\n");
+    memcpy(p, tag, 4);
+    PUT32LE(p + 4, *len);
+    memcpy(p + 8, data, *len);
+    PUT32LE(p + 8 + *len, rkcrc32(0, data, *len));
+    free(data);
+    *len += 12;
+    return p;
+}
+
+static void boot_load(struct job *j, int i, const char *path, const char *tag) {
+    uint8_t *data = NULL, *p;
+    size_t len = 0, alloc = 0;
+    ssize_t nr;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        fatal("%s: %s\n", path, strerror(errno));
+    for (;;) {
+        if (len == alloc) {
+            alloc = alloc ? alloc * 2 : 1 << 20;
+            if (!(p = realloc(data, alloc)))
+                fatal("out of memory\n");
+            data = p;
+        }
+        if ((nr = read(fd, data + len, alloc - len)) < 0) {
+            if (errno == EINTR) continue;
+            fatal("%s: %s\n", path, strerror(errno));
+        }
+        if (!nr) break;
+        len += nr;
+    }
+    close(fd);
+    if (len > 0xffffffff - 12)
+        fatal("%s: too large\n", path);
+
+    j->boot_len[i] = len;
+    j->boot[i] = tag ? sign_image(tag, data, &j->boot_len[i]) : data;
+}
+
+static void job_free(struct job *j) {
+    int i;
+
+    rkimage_free(&j->image);
+    for (i = 0; i < 3; i++) {
+        free(j->boot[i]);
+        j->boot[i] = NULL;
+    }
+    for (i = 0; i < 2; i++) {
+        free(j->tmp[i]);
+        j->tmp[i] = NULL;
+    }
+}
+
+static void parse_job(struct job *j, int argc, char **argv) {
+    char action;
+    int offset = 0, size = 0;
+    uint8_t flag = 0;
+    char *partname = NULL;
+
+    if (!argc) usage();
+
+    memset(j, 0, sizeof(*j));
+    /* whole-word actions first, then the single letter ones */
+    if (!strcmp(*argv, "list"))
+        action = 't';
+    else if (!strcmp(*argv, "badblocks"))
+        action = 'x';
+    else if (!strcmp(*argv, "rawdump"))
+        action = 'z';
+    else if (!strcmp(*argv, "boot"))
+        action = 'k';
+    else if ((action = **argv) == 't' || action == 'x' || action == 'z' ||
+             action == 'k')
+        usage();
+    NEXT;
+
+    switch(action) {
+    case 'b':
+        if (argc > 1) usage();
+        else if (argc == 1)
+            flag = strtoul(argv[0], NULL, 0);
         break;
-    case 'P':   /* Write parameters */
-        {
-            /* Header */
-            strncpy((char *)buf, "PARM", 4);
+    case 'l':
+    case 'L':
+        if (argc) usage();
+        /* read and sign the image before touching the device */
+        if (rkimage_load(&j->image, 0, action == 'l' ? RKLOAD_DDR : RKLOAD_USBPLUG) < 0)
+            fatal("read error: %s\n", strerror(errno));
+        break;
+    case 'e':
+    case 'r':
+    case 'w':
+        if (argc < 1 || argc > 2) usage();
+        if (argc == 1) {
+            partname = argv[0];
+        } else {
+            offset = strtoul(argv[0], NULL, 0);
+            size   = strtoul(argv[1], NULL, 0);
+        }
+        break;
+    case 'k':
+        if (argc != 2 && argc != 3) usage();
+        /* read them before touching the device, the kernel signed now */
+        boot_load(j, 0, argv[0], "KRNL");
+        boot_load(j, 1, argv[1], NULL);
+        if (argc == 3)
+            boot_load(j, 2, argv[2], NULL);
+        break;
+    case 'z':
+        if (argc != 0 && argc != 2) usage();
+        if (argc) {
+            offset = strtoul(argv[0], NULL, 0);
+            size   = strtoul(argv[1], NULL, 0);
+        }
+        break;
+    case 'm':
+    case 'M':
+    case 'B':
+    case 'i':
+    case 'j':
+        if (argc != 2) usage();
+        offset = strtoul(argv[0], NULL, 0);
+        size   = strtoul(argv[1], NULL, 0);
+        break;
+    case 't':
+    case 'x':
+    case 'n':
+    case 'v':
+    case 'p':
+    case 'P':
+        if (argc) usage();
+        offset = 0;
+        size   = 1024;
+        break;
+    default:
+        usage();
+    }
 
-            /* Content */
-            int sizeRead;
-            if ((sizeRead = read(0, buf + 8, RKFT_BLOCKSIZE - 8)) < 0) {
-                info("read error: %s\n", strerror(errno));
-                goto exit;
-            }
+    j->action   = action;
+    j->offset   = offset;
+    j->size     = size;
+    j->flag     = flag;
+    j->partname = partname;
+}
 
-            /* Length */
-            *(uint32_t *)(buf + 4) = sizeRead;
+/* Connect to device */
 
-            /* CRC */
-            uint32_t crc = 0;
-            crc = rkcrc32(crc, buf + 8, sizeRead);
-            PUT32LE(buf + 8 + sizeRead, crc);
-
-            /*
-             * The parameter file is written at 8 different offsets:
-             * 0x0000, 0x0400, 0x0800, 0x0C00, 0x1000, 0x1400, 0x1800, 0x1C00
-             */
-
-            for(offset = 0; offset < 0x2000; offset += 0x400) {
-                infocr("writing flash memory at offset 0x%08x", offset);
-                send_cmd(RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR);
-                send_buf(RKFT_BLOCKSIZE);
-                recv_res();
+static void claim_device(void) {
+    struct libusb_device_descriptor desc;
+
+    if (libusb_kernel_driver_active(h, 0) == 1) {
+        info("kernel driver active\n");
+        if (!libusb_detach_kernel_driver(h, 0))
+            info("driver detached\n");
+    }
+
+    if (libusb_claim_interface(h, 0) < 0)
+        fatal("cannot claim interface\n");
+    info("interface claimed\n");
+
+    if (libusb_get_device_descriptor(libusb_get_device(h), &desc) != 0)
+        fatal("cannot get device descriptor\n");
+
+    if (desc.bcdUSB == 0x200)
+        info("MASK ROM MODE\n");
+}
+
+/*
+ * Input of w, j and M: decompressed by rkzip, with the bytes read to look
+ * at the header pushed back in front. boot points in_back at an image in
+ * memory instead, with nothing behind it.
+ */
+
+static uint8_t in_head[32];
+static const uint8_t *in_back = in_head;
+static size_t in_back_len, in_back_pos;
+
+static ssize_t in_read(void *p, size_t len) {
+    size_t n = in_back_len - in_back_pos;
+    ssize_t r;
+
+    if (n > len) n = len;
+    memcpy(p, in_back + in_back_pos, n);
+    in_back_pos += n;
+    if (n == len || in_back != in_head) return n;
+    if ((r = rkzip_read(&unzip, (uint8_t *)p + n, len - n)) < 0)
+        fatal("read error: %s\n", unzip.errmsg);
+    return n + r;
+}
+
+static void in_read_all(void *p, size_t len) {
+    if ((size_t)in_read(p, len) != len)
+        fatal("premature end-of-file reached.\n");
+}
+
+/*
+ * Android sparse images (as made by img2simg). RAW chunks are written as
+ * they come, FILL chunks are expanded here and DONT_CARE chunks are skipped,
+ * or filled with 0xff like 'e' does with --erase-skipped.
+ */
+
+#define SPARSE_MAGIC        0xed26ff3a
+#define SPARSE_HEADER_LEN   28
+#define CHUNK_HEADER_LEN    12
+#define CHUNK_RAW           0xcac1
+#define CHUNK_FILL          0xcac2
+#define CHUNK_DONT_CARE     0xcac3
+#define CHUNK_CRC32         0xcac4
+
+static void write_sparse(uint32_t offset, uint32_t size, const uint8_t *hdr) {
+    static const uint8_t zero[RKFT_BLOCKSIZE];
+    uint32_t blk_sz = GET32LE(hdr + 12), total_blks = GET32LE(hdr + 16);
+    uint32_t nchunks = GET32LE(hdr + 20), crc = 0, expect, i, n, blks = 0;
+    uint16_t hdr_len = GET16LE(hdr + 8), chunk_hdr_len = GET16LE(hdr + 10);
+    uint64_t total, left, written = 0, skipped = 0;
+    uint8_t chunk[CHUNK_HEADER_LEN], skip[64];
+
+    if (GET16LE(hdr + 4) != 1 || hdr_len < SPARSE_HEADER_LEN ||
+            chunk_hdr_len < CHUNK_HEADER_LEN || !blk_sz || blk_sz % 512)
+        fatal("unsupported sparse image\n");
+    total = (uint64_t)total_blks * blk_sz / 512;
+    if (total > size)
+        fatal("sparse image (0x%08llx sectors) does not fit in 0x%08x sectors\n",
+              (unsigned long long)total, size);
+    info("sparse image: %u chunks, %u blocks of %u bytes\n",
+         nchunks, total_blks, blk_sz);
+
+    for (n = hdr_len - SPARSE_HEADER_LEN; n; n -= i)
+        in_read_all(skip, i = n < sizeof(skip) ? n : sizeof(skip));
+
+    while (nchunks--) {
+        in_read_all(chunk, CHUNK_HEADER_LEN);
+        for (n = chunk_hdr_len - CHUNK_HEADER_LEN; n; n -= i)
+            in_read_all(skip, i = n < sizeof(skip) ? n : sizeof(skip));
+
+        uint16_t type = GET16LE(chunk);
+        uint32_t data = GET32LE(chunk + 8) - chunk_hdr_len;
+        left = (uint64_t)GET32LE(chunk + 4) * blk_sz;
+
+        /* total_blks fits, so the chunks must not add up to more */
+        if (GET32LE(chunk + 4) > total_blks - blks)
+            fatal("sparse chunks exceed the image's %u blocks\n", total_blks);
+        blks += GET32LE(chunk + 4);
+
+        switch (type) {
+        case CHUNK_RAW:
+            if (data != left) fatal("bad sparse chunk length\n");
+            break;
+        case CHUNK_FILL:
+            if (data != 4) fatal("bad sparse chunk length\n");
+            in_read_all(buf, 4);
+            for (i = 4; i < RKFT_BLOCKSIZE; i *= 2)
+                memcpy(buf + i, buf, i);
+            break;
+        case CHUNK_DONT_CARE:
+            if (data) fatal("bad sparse chunk length\n");
+            if (erase_skipped) memset(buf, 0xff, RKFT_BLOCKSIZE);
+            break;
+        case CHUNK_CRC32:
+            if (data != 4) fatal("bad sparse chunk length\n");
+            in_read_all(chunk, 4);
+            if ((expect = GET32LE(chunk)) != crc)
+                fatal("bad CRC! (%#x, should be %#x)\n", expect, crc);
+            continue;
+        default:
+            fatal("unknown sparse chunk type %#x\n", type);
+        }
+
+        while (left) {
+            n = left < RKFT_BLOCKSIZE ? left : RKFT_BLOCKSIZE;
+            left -= n;
+
+            /* the image CRC counts holes as zeros */
+            if (type == CHUNK_RAW)
+                in_read_all(buf, n);
+            crc = crc32(crc, type == CHUNK_DONT_CARE ? zero : buf, n);
+
+            if (type == CHUNK_DONT_CARE && !erase_skipped) {
+                skipped += n;
+                offset += n / 512;
+                progress("writing", offset, n);
+                continue;
             }
+            send_cmd(RKFT_CMD_WRITELBA, offset, n / 512);
+            send_buf(n);
+            recv_res();
+            written += n;
+            offset += n / 512;
+            progress("writing", offset, n);
         }
-        fprintf(stderr, "... Done!\n");
-        break;
-    case 'm':   /* Read RAM */
-        while (size > 0) {
-            int sizeRead = size > RKFT_BLOCKSIZE ? RKFT_BLOCKSIZE : size;
-            infocr("reading memory at offset 0x%08x size %x", offset, sizeRead);
+    }
+    if (blks != total_blks)
+        fatal("sparse chunks cover %u of %u blocks\n", blks, total_blks);
+    progress_done("writing");
+    info("%llu bytes written, %llu bytes skipped\n",
+         (unsigned long long)written, (unsigned long long)skipped);
+}
+
+/*
+ * Journal of a long r or w. Every RKFT_JOURNAL_SPAN sectors that made it
+ * (read and written out, or written and acknowledged) are appended with
+ * their CRC, so that --resume can continue where a failed run stopped.
+ * Only the last range is checked again on resume: against the output file
+ * for r, against the flash for w. The skipped input of w has to match the
+ * journal as well.
+ */
+
+#define RKFT_JOURNAL_SPAN   0x800       /* sectors, 1 MiB */
+
+static FILE *journal;
+static uint32_t jr_start, jr_len, jr_crc;   /* range being collected */
 
-            send_cmd(RKFT_CMD_READSDRAM, offset - SDRAM_BASE_ADDRESS, sizeRead);
-            recv_buf(sizeRead);
+static void journal_line(uint32_t offset, uint32_t nsectors, uint32_t crc) {
+    fprintf(journal, "%08x %08x %08x\n", offset, nsectors, crc);
+    fflush(journal);
+#ifndef _WIN32
+    fsync(fileno(journal));
+#endif
+}
+
+static void journal_add(uint32_t offset, const uint8_t *data, uint32_t nsectors) {
+    if (!journal) return;
+    if (!jr_len) {
+        jr_start = offset;
+        jr_crc = 0;
+    }
+    jr_crc = rkcrc32(jr_crc, (uint8_t *)data, nsectors * 512);
+    jr_len += nsectors;
+    if (jr_len >= RKFT_JOURNAL_SPAN) {
+        journal_line(jr_start, jr_len, jr_crc);
+        jr_len = 0;
+    }
+}
+
+static void journal_close(void) {
+    if (!journal) return;
+    if (jr_len) journal_line(jr_start, jr_len, jr_crc);
+    fclose(journal);
+    journal = NULL;
+    jr_len = 0;
+}
+
+/* Checks the last range as it is now, on the flash (w) or in the output (r) */
+static int journal_verify(char action, uint32_t offset, uint32_t nsectors,
+                          uint64_t pos, uint32_t expect) {
+    uint32_t crc = 0, n;
+    int fd = 1;
+    ssize_t got = 0;
+
+    if (action == 'r') {
+        /* >>file is write-only, so it is read back through its name */
+        if ((fd = open("/proc/self/fd/1", O_RDONLY)) < 0)
+            fd = 1;
+        if (lseek(fd, pos, SEEK_SET) < 0) {
+            if (fd != 1) close(fd);
+            return 0;
+        }
+    }
+    for (; nsectors; nsectors -= n, offset += n) {
+        n = nsectors < RKFT_OFF_INCR ? nsectors : RKFT_OFF_INCR;
+        if (action == 'w') {
+            send_cmd(RKFT_CMD_READLBA, offset, n);
+            recv_buf(n * 512);
             recv_res();
+        } else if ((got = read(fd, buf, n * 512)) != (ssize_t)n * 512) {
+            if (got < 0 && errno == EBADF)
+                fatal("cannot read back the output, open it with 1<>file\n");
+            got = -1;
+            break;
+        }
+        crc = rkcrc32(crc, buf, n * 512);
+    }
+    if (fd != 1) close(fd);
+    return got >= 0 && crc == expect;
+}
 
-            if (write(1, buf, sizeRead) <= 0)
-                fatal("Write error! Disk full?\n");
+/*
+ * Opens the journal for an r or w of size sectors at offset. Returns the
+ * number of sectors already done, which are also skipped on the input of w.
+ */
+static uint32_t journal_open(char action, uint32_t offset, uint32_t size) {
+    struct { uint32_t start, len, crc; } *r = NULL;
+    uint32_t o, s, done = 0, i, n = 0, alloc = 0, c, left;
+    char line[64], a;
+    struct stat st;
+    ssize_t got;
+    FILE *f;
+
+    if (resume && (f = fopen(journal_path, "r"))) {
+        if (!fgets(line, sizeof(line), f) ||
+                sscanf(line, "rkflashtool-journal 1 %c %x %x", &a, &o, &s) != 3 ||
+                a != action || o != offset || s != size)
+            fatal("%s does not belong to this job\n", journal_path);
+        for (;;) {
+            if (n == alloc && !(r = realloc(r, (alloc += 1024) * sizeof(*r))))
+                fatal("out of memory\n");
+            if (!fgets(line, sizeof(line), f) ||
+                    sscanf(line, "%x %x %x", &r[n].start, &r[n].len, &r[n].crc) != 3 ||
+                    r[n].start != offset + done || done + r[n].len > size)
+                break;
+            done += r[n++].len;
+        }
+        fclose(f);
+
+        if (action == 'r') {
+            if (zip_method)
+                fatal("cannot resume a compressed read\n");
+            if (fstat(1, &st) < 0 || !S_ISREG(st.st_mode))
+                fatal("resuming r needs the output in a file (>>file)\n");
+            /* whatever did not make it to the file has to be read again */
+            while (n && (uint64_t)done * 512 > (uint64_t)st.st_size)
+                done -= r[--n].len;
+        }
 
-            offset += sizeRead;
-            size -= sizeRead;
+        /* the boundary: the last range may not have made it after all */
+        if (n) {
+            n--;
+            done -= r[n].len;
+            if (journal_verify(action, r[n].start, r[n].len,
+                               (uint64_t)done * 512, r[n].crc))
+                done += r[n++].len;
+            else
+                info("last journaled range at 0x%08x failed, redoing it\n",
+                     r[n].start);
         }
-        fprintf(stderr, "... Done!\n");
-        break;
-    case 'M':   /* Write RAM */
-        while (size > 0) {
-            int sizeRead;
-            if ((sizeRead = read(0, buf, RKFT_BLOCKSIZE)) <= 0) {
-                info("premature end-of-file reached.\n");
-                goto exit;
+
+        if (action == 'r') {
+            if (ftruncate(1, (off_t)done * 512) < 0 ||
+                    lseek(1, (off_t)done * 512, SEEK_SET) < 0)
+                fatal("cannot resume output: %s\n", strerror(errno));
+        } else {
+            /* skip what is done on the input, it has to be the same data */
+            for (i = 0; i < n; i++) {
+                for (c = 0, left = r[i].len; left; left -= s) {
+                    s = left < RKFT_OFF_INCR ? left : RKFT_OFF_INCR;
+                    if ((got = in_read(buf, s * 512)) <= 0)
+                        fatal("input is shorter than the journal\n");
+                    memset(buf + got, 0, s * 512 - got);
+                    c = rkcrc32(c, buf, s * 512);
+                }
+                if (c != r[i].crc)
+                    fatal("input does not match the journal at 0x%08x\n",
+                          r[i].start);
             }
-            infocr("writing memory at offset 0x%08x size %x", offset, sizeRead);
+        }
+        if (done)
+            info("resuming at offset 0x%08x, 0x%08x sectors done\n",
+                 offset + done, done);
+    }
 
-            send_cmd(RKFT_CMD_WRITESDRAM, offset - SDRAM_BASE_ADDRESS, sizeRead);
-            send_buf(sizeRead);
-            recv_res();
+    if (!(journal = fopen(journal_path, "w")))
+        fatal("%s: %s\n", journal_path, strerror(errno));
+    fprintf(journal, "rkflashtool-journal 1 %c %08x %08x\n", action, offset, size);
+    for (i = 0; i < n; i++)
+        fprintf(journal, "%08x %08x %08x\n", r[i].start, r[i].len, r[i].crc);
+    fflush(journal);
+    free(r);
+    jr_len = 0;
+    return done;
+}
 
-            offset += sizeRead;
-            size -= sizeRead;
+/*
+ * Bad blocks
+ *
+ * The badblocks action asks the loader about every erase block, using the
+ * geometry of READFLASHINFO, RKFT_BAD_BATCH blocks per TESTBADBLOCK, which
+ * answers with a bit per block. The result is kept as a bitmap per device
+ * serial number in the cache directory, so rawdump can warn about the bad
+ * blocks its pages are in, or with --skip-bad leave them out. The blocks
+ * are physical, so they mean nothing to r and w, whose addresses go
+ * through the loader's FTL (which maps bad blocks out by itself).
+ */
+
+#define RKFT_BAD_BATCH      512     /* blocks, the reply has 64 bytes */
+
+static struct {
+    char serial[128];               /* of the device the map is for */
+    uint32_t nblocks, block;        /* block in sectors */
+    uint8_t *map;
+    uint32_t reported;              /* blocks up to here were warned about */
+} bad;
+
+static void device_serial(char *s, int n) {
+    struct libusb_device_descriptor desc;
+    char *p;
+
+    s[0] = 0;
+    if (libusb_get_device_descriptor(libusb_get_device(h), &desc) ||
+            !desc.iSerialNumber ||
+            libusb_get_string_descriptor_ascii(h, desc.iSerialNumber,
+                                               (unsigned char *)s, n) < 0)
+        s[0] = 0;
+    /* it becomes part of a file name */
+    for (p = s; *p; p++)
+        if (*p == '/' || *p < ' ' || *p > '~') *p = '_';
+}
+
+#ifndef _WIN32
+static char *bad_path(const char *serial, int create) {
+    char name[160];
+
+    snprintf(name, sizeof(name), "badblocks-%s", serial);
+    return cache_path(name, create);
+}
+
+static int bad_load(const char *serial) {
+    char *path = bad_path(serial, 0), line[64];
+    uint32_t nblocks, block;
+    uint8_t *map;
+    FILE *f;
+
+    if (!path || !(f = fopen(path, "rb"))) return -1;
+    if (!fgets(line, sizeof(line), f) ||
+            sscanf(line, "rkflashtool-badblocks 1 %u %u", &nblocks, &block) != 2 ||
+            !block || !(map = malloc((nblocks + 7) / 8))) {
+        fclose(f);
+        return -1;
+    }
+    if (fread(map, 1, (nblocks + 7) / 8, f) != (nblocks + 7) / 8) {
+        free(map);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    free(bad.map);
+    bad.map = map;
+    bad.nblocks = nblocks;
+    bad.block = block;
+    snprintf(bad.serial, sizeof(bad.serial), "%s", serial);
+    return 0;
+}
+
+static void bad_save(void) {
+    char *path = bad_path(bad.serial, 1);
+    FILE *f;
+
+    if (!path || !(f = fopen(path, "wb"))) {
+        info("cannot keep the bad block map: %s\n", strerror(errno));
+        return;
+    }
+    fprintf(f, "rkflashtool-badblocks 1 %u %u\n", bad.nblocks, bad.block);
+    fwrite(bad.map, 1, (bad.nblocks + 7) / 8, f);
+    fclose(f);
+}
+#else
+static int bad_load(const char *serial) { return -1; }
+static void bad_save(void) { }
+#endif
+
+/* 1 if this device was scanned and its map is loaded */
+static int bad_known(void) {
+    char serial[128];
+
+    device_serial(serial, sizeof(serial));
+    bad.reported = 0;
+    if (!*serial) return 0;
+    if (bad.map && !strcmp(serial, bad.serial)) return 1;
+    return bad_load(serial) == 0;
+}
+
+static int bad_block(uint32_t b) {
+    return b < bad.nblocks && bad.map[b / 8] >> (b % 8) & 1;
+}
+
+/* 1 if the range touches a bad block, which is reported once */
+static int bad_range(uint32_t offset, uint32_t nsectors) {
+    uint32_t b = offset / bad.block, last = (offset + nsectors - 1) / bad.block;
+    int hit = 0;
+
+    for (; b <= last; b++) {
+        if (!bad_block(b)) continue;
+        hit = 1;
+        if (b >= bad.reported) {
+            info("0x%08x: block %u is bad%s\n", b * bad.block, b,
+                 skip_bad ? ", skipped" : "");
+            bad.reported = b + 1;
         }
-        fprintf(stderr, "... Done!\n");
-        break;
-    case 'B':   /* Exec RAM */
-        info("booting kernel...\n");
-        send_exec(offset - SDRAM_BASE_ADDRESS, size - SDRAM_BASE_ADDRESS);
+    }
+    return hit;
+}
+
+static void scan_bad_blocks(void) {
+    uint32_t nblocks, b, n, i, nbad = 0;
+
+    read_flash_size();
+    if (!flash_info.block_size)
+        fatal("the flash reports no block size\n");
+    nblocks = flash_size / flash_info.block_size;
+    info("%u blocks of %u sectors\n", nblocks, flash_info.block_size);
+
+    free(bad.map);
+    if (!(bad.map = calloc((nblocks + 7) / 8, 1)))
+        fatal("out of memory\n");
+    bad.nblocks = nblocks;
+    bad.block = flash_info.block_size;
+    device_serial(bad.serial, sizeof(bad.serial));
+
+    prog.total = (uint64_t)nblocks * flash_info.block_size * 512;
+    for (b = 0; b < nblocks; b += n) {
+        n = nblocks - b < RKFT_BAD_BATCH ? nblocks - b : RKFT_BAD_BATCH;
+        send_cmd(RKFT_CMD_TESTBADBLOCK, b, n);
+        recv_buf(RKFT_BAD_BATCH / 8);
         recv_res();
-        break;
-    case 'i':   /* Read IDB */
-        while (size > 0) {
-            int sizeRead = size > RKFT_IDB_INCR ? RKFT_IDB_INCR : size;
-            infocr("reading IDB flash memory at offset 0x%08x", offset);
+        for (i = 0; i < n; i++)
+            if (buf[i / 8] >> (i % 8) & 1) {
+                bad.map[(b + i) / 8] |= 1 << (b + i) % 8;
+                nbad++;
+            }
+        progress("scanning", (b + n) * flash_info.block_size,
+                 (uint64_t)n * flash_info.block_size * 512);
+    }
+    progress_done("scanning");
+
+    for (b = 0; b < nblocks; b++)
+        if (bad_block(b))
+            printf("%u\t0x%08x\t0x%08x\n", b, b * flash_info.block_size,
+                   flash_info.block_size);
+    info("%u of %u blocks bad\n", nbad, nblocks);
+    if (*bad.serial)
+        bad_save();
+    else
+        info("the device has no serial number, the map is not kept\n");
+}
 
-            send_cmd(RKFT_CMD_READSECTOR, offset, sizeRead);
-            recv_buf(RKFT_IDB_BLOCKSIZE * sizeRead);
-            recv_res();
+/*
+ * Command queue for r and w. A bulk endpoint keeps the order of what is
+ * queued on it, so the CBWs and OUT data of several commands can go out
+ * back to back while their IN data and CSWs are waited for in the same
+ * order on the other endpoint. The loader still runs one command at a
+ * time; the queue only takes the turnaround out between them.
+ *
+ * Every command in flight has a slot. A CSW that comes in is looked up by
+ * its tag and has to belong to the slot it was queued for, else the two
+ * endpoints are out of step. After any failure the queue is cancelled and
+ * the commands still in it are run again one by one, with the retries of
+ * recv_res().
+ */
 
-            if (write(1, buf, RKFT_IDB_BLOCKSIZE * sizeRead) <= 0)
-                fatal("Write error! Disk full?\n");
+#define RKFT_QUEUE_SLACK    25      /* ms per queued command on top of the timeout */
+
+struct slot {
+    uint32_t tag, command, offset;
+    uint32_t count, len;            /* sectors, bytes of the data phase */
+    int dir;                        /* as xfer.dir */
+    uint8_t cbw[31], csw[13];
+    uint8_t *data;
+    struct libusb_transfer *t[3];   /* CBW, data, CSW */
+    int pending;                    /* transfers not back yet */
+    int skipped;                    /* a known bad block, not sent */
+    int error, status;
+    uint32_t residue;
+    double t_cbw;                   /* the CBW was taken */
+};
+
+static struct slot slots[RKFT_MAX_DEPTH];
+static int q_head, q_count;
+
+static struct slot *find_slot(const uint8_t *tag) {
+    int i;
+
+    for (i = 0; i < q_count; i++) {
+        struct slot *s = &slots[(q_head + i) % depth];
+        if (!memcmp(s->cbw + 4, tag, 4))
+            return s;
+    }
+    return NULL;
+}
+
+static void LIBUSB_CALL slot_cb(struct libusb_transfer *t) {
+    struct slot *s = t->user_data;
+    int e;
+
+    switch (t->status) {
+    case LIBUSB_TRANSFER_COMPLETED: e = 0;                          break;
+    case LIBUSB_TRANSFER_TIMED_OUT: e = LIBUSB_ERROR_TIMEOUT;       break;
+    case LIBUSB_TRANSFER_STALL:     e = LIBUSB_ERROR_PIPE;          break;
+    case LIBUSB_TRANSFER_NO_DEVICE: e = LIBUSB_ERROR_NO_DEVICE;     break;
+    case LIBUSB_TRANSFER_OVERFLOW:  e = LIBUSB_ERROR_OVERFLOW;      break;
+    case LIBUSB_TRANSFER_CANCELLED: e = LIBUSB_ERROR_INTERRUPTED;   break;
+    default:                        e = LIBUSB_ERROR_IO;            break;
+    }
+    rkpcap_usb(&trace, (uintptr_t)t, t->endpoint, 1, trace_status(e),
+               t->buffer, t->endpoint & LIBUSB_ENDPOINT_IN ? t->actual_length : 0);
+
+    s->pending--;
+    if (s->error)
+        return;
+    if (e) {
+        s->error = e;
+        return;
+    }
 
-            offset += sizeRead;
-            size -= sizeRead;
+    if (t == s->t[0])
+        s->t_cbw = rk_now();
+    if (t == s->t[2]) {
+        /* the tag says whose CSW this is, and it has to be this slot's */
+        if (t->actual_length == 13 && !memcmp(s->csw, "USBS", 4) &&
+                find_slot(s->csw + 4) != s) {
+            s->error = RKFT_ERR_TAG;
+            return;
         }
-        fprintf(stderr, "... Done!\n");
-        break;
-    case '1':   /* Read IDB */
-        while (size > 0) {
-            int sizeRead = size > RKFT_IDB_INCR ? RKFT_IDB_INCR : size;
-            infocr("reading IDB flash memory at offset 0x%08x", offset);
+        s->error = check_csw(s->csw, t->actual_length, s->cbw + 4,
+                             s->command, &s->status, &s->residue);
+        if (!s->error)
+            lat_add(s->command, rk_now() - s->t_cbw);
+    } else if (t->actual_length != t->length) {
+        /* a short data phase leaves the CSW where the next data belongs */
+        s->error = LIBUSB_ERROR_IO;
+    }
+}
 
-            send_cmd(RKFT_CMD_READSECTOR, offset, sizeRead);
-            recv_buf(RKFT_IDB_BLOCKSIZE * sizeRead);
-            recv_res();
+static void queue_init(void) {
+    int i, k;
+
+    for (i = 0; i < RKFT_MAX_DEPTH; i++) {
+        struct slot *s = &slots[i];
+        if (s->data) continue;
+        for (k = 0; k < 3; k++)
+            if (!(s->t[k] = libusb_alloc_transfer(0)))
+                fatal("out of memory\n");
+        if (!(s->data = malloc(RKFT_BUFSIZE)))
+            fatal("out of memory\n");
+    }
+    q_head = q_count = 0;
+}
+
+static void queue_submit(struct slot *s, uint32_t command, uint32_t offset) {
+    unsigned int timeout = cmd_timeout(command, s->count) +
+                           RKFT_QUEUE_SLACK * depth;
+    int k, r;
+
+    s->tag     = new_tag();
+    s->command = command;
+    s->offset  = offset;
+    s->dir     = command & 0x80000000 ? 1 : 2;     /* reads have the top bit */
+    s->error   = s->status = 0;
+    s->residue = 0;
+    s->pending = 0;
+    s->skipped = 0;
+
+    memset(s->cbw, 0, 31);
+    memcpy(s->cbw, "USBC", 4);
+    SETBE32(s->cbw+4, s->tag);
+    SETBE32(s->cbw+12, command);
+    SETBE32(s->cbw+17, offset);
+    SETBE16(s->cbw+22, s->count);
+
+    libusb_fill_bulk_transfer(s->t[0], h, 2|LIBUSB_ENDPOINT_OUT, s->cbw,
+                              sizeof(s->cbw), slot_cb, s, timeout);
+    libusb_fill_bulk_transfer(s->t[1], h, s->dir == 1 ? 1|LIBUSB_ENDPOINT_IN
+                              : 2|LIBUSB_ENDPOINT_OUT, s->data,
+                              s->len, slot_cb, s, timeout);
+    libusb_fill_bulk_transfer(s->t[2], h, 1|LIBUSB_ENDPOINT_IN, s->csw,
+                              sizeof(s->csw), slot_cb, s, timeout);
+    for (k = 0; k < 3; k++) {
+        rkpcap_usb(&trace, (uintptr_t)s->t[k], s->t[k]->endpoint, 0, 0,
+                   s->t[k]->buffer, s->t[k]->endpoint & LIBUSB_ENDPOINT_IN ?
+                   0 : s->t[k]->length);
+        if ((r = libusb_submit_transfer(s->t[k])) < 0) {
+            s->error = r;
+            break;
+        }
+        s->pending++;
+    }
+}
+
+/* Takes back every transfer still queued, the slots stay as they are */
+static void queue_cancel(void) {
+    int i, k, pending;
+
+    for (i = 0; i < q_count; i++)
+        for (k = 0; k < 3; k++)
+            libusb_cancel_transfer(slots[(q_head + i) % depth].t[k]);
+    do {
+        for (pending = i = 0; i < q_count; i++)
+            pending += slots[(q_head + i) % depth].pending;
+        if (pending)
+            libusb_handle_events_completed(c, NULL);
+    } while (pending);
+}
+
+static void queue_fail(void) {
+    struct slot *s = &slots[q_head];
+    int i;
+
+    queue_cancel();
+    xfer_event(s->error, s->command, s->offset, s->status, s->residue,
+               s->error == LIBUSB_ERROR_NO_DEVICE ? "fatal" : "requeue");
+    if (s->error == LIBUSB_ERROR_NO_DEVICE)
+        fatal("command 0x%08x at 0x%08x failed: %s\n", s->command, s->offset,
+              xfer_error(s->error, s->status, s->residue));
+    info("command 0x%08x at 0x%08x (tag %08x): %s, "
+         "running %d queued commands one by one\n", s->command, s->offset,
+         s->tag, xfer_error(s->error, s->status, s->residue), q_count);
+    xfer_recover();
+
+    for (i = 0; i < q_count; i++) {
+        s = &slots[(q_head + i) % depth];
+        if (s->skipped) continue;
+        send_cmd(s->command, s->offset, s->count);
+        if (s->dir == 2) {
+            memcpy(buf, s->data, s->len);
+            send_buf(s->len);
+        } else {
+            recv_buf(s->len);
+        }
+        recv_res();
+        if (s->dir == 1)
+            memcpy(s->data, buf, s->len);
+        s->error = 0;
+    }
+}
+
+/* Waits for the oldest command, commands finish in order */
+static struct slot *queue_wait(void) {
+    struct slot *s = &slots[q_head];
+
+    while (s->pending && !s->error)
+        libusb_handle_events_completed(c, NULL);
+    if (s->error)
+        queue_fail();
+    return s;
+}
+
+static void queue_pop(void) {
+    q_head = (q_head + 1) % depth;
+    q_count--;
+}
+
+/*
+ * Reads (r, i, m, z) or writes (w, j, M) size units at offset, depth
+ * commands deep: r and w go by RKFT_OFF_INCR sectors of the LBA area, i
+ * and j by RKFT_IDB_INCR sectors of RKFT_IDB_BLOCKSIZE bytes of the IDB
+ * area, m and M by RKFT_MEM_BLOCKSIZE bytes of SDRAM (offset from its
+ * base), z by as many raw pages (with spare) as fit in RKFT_BUFSIZE.
+ */
+static void queue_rw(char action, uint32_t offset, int size) {
+    int lba = action == 'r' || action == 'w';
+    int reading = !strchr("wjM", action);
+    uint32_t command = action == 'r' ? RKFT_CMD_READLBA :
+                       action == 'w' ? RKFT_CMD_WRITELBA :
+                       action == 'i' ? RKFT_CMD_READSECTOR :
+                       action == 'j' ? RKFT_CMD_WRITESECTOR :
+                       action == 'm' ? RKFT_CMD_READSDRAM :
+                       action == 'M' ? RKFT_CMD_WRITESDRAM : RKFT_CMD_READSPARE;
+    uint32_t secsize = lba ? 512 : strchr("mM", action) ? 1 : action == 'z' ?
+                       flash_info.page_size * (512 + RKRAW_SPARE) : RKFT_IDB_BLOCKSIZE;
+    uint32_t incr = lba ? RKFT_OFF_INCR : strchr("ij", action) ? RKFT_IDB_INCR :
+                    RKFT_BUFSIZE / secsize;
+    const char *what = lba || strchr("mM", action) ? (reading ? "reading" : "writing") :
+                       action == 'z' ? "reading raw" :
+                       reading ? "reading IDB" : "writing IDB";
+    struct slot *s;
+    int eof = 0, known = action == 'z' && bad_known();
+    ssize_t n;
+
+    queue_init();
+    for (;;) {
+        while (q_count < depth && size > 0 && !eof) {
+            s = &slots[(q_head + q_count) % depth];
+            /* r and w always move whole blocks, the others stop at size */
+            s->count = lba || (uint32_t)size > incr ? incr : (uint32_t)size;
+            s->len   = s->count * secsize;
+            if (!reading) {
+                if (!(n = in_read(s->data, s->len))) {
+                    eof = 1;
+                    break;
+                }
+                /* a short last block is padded, not filled with stale data;
+                 * SDRAM takes any length */
+                if (action == 'M')
+                    s->count = s->len = n;
+                else
+                    memset(s->data + n, 0, s->len - n);
+            }
+            q_count++;
+            if (known && bad_range(offset * flash_info.page_size,
+                                   s->count * flash_info.page_size) &&
+                    skip_bad) {
+                /* reads of it give what erased flash does */
+                memset(s->data, 0xff, s->len);
+                s->command = command;
+                s->offset = offset;
+                s->pending = s->error = 0;
+                s->skipped = 1;
+            } else {
+                queue_submit(s, command, offset);
+            }
+            offset += s->count;
+            size   -= s->count;
+        }
+        if (!q_count)
+            break;
+
+        s = queue_wait();
+        progress(what, s->offset + s->count, s->len);
+        if (reading &&
+                (action == 'r' && zip_method
+                    ? rkzip_write(&zip, s->data, s->len) < 0
+                    : write(1, s->data, s->len) <= 0))
+            fatal("Write error! Disk full?\n");
+        if (lba)
+            journal_add(s->offset, s->data, s->count);
+        queue_pop();
+    }
+    progress_done(what);
+    if (eof)
+        info("premature end-of-file reached.\n");
+}
+
+/*
+ * All parameter copies are written or read through the queue at once.
+ */
+
+/* Writes data to the first nsectors of every copy, or reads them into data */
+static void param_copies(int writing, uint8_t *data, uint32_t nsectors) {
+    uint32_t len = nsectors * 512;
+    int next = 0, done;
+    struct slot *s;
+
+    queue_init();
+    for (done = 0; done < RKFT_PARAM_COPIES; done++) {
+        while (q_count < depth && next < RKFT_PARAM_COPIES) {
+            s = &slots[(q_head + q_count) % depth];
+            s->count = nsectors;
+            s->len   = len;
+            if (writing) memcpy(s->data, data, len);
+            q_count++;
+            queue_submit(s, writing ? RKFT_CMD_WRITELBA : RKFT_CMD_READLBA,
+                         next++ * RKFT_PARAM_STRIDE);
+        }
+        s = queue_wait();
+        if (!writing)
+            memcpy(data + s->offset / RKFT_PARAM_STRIDE * len, s->data, len);
+        queue_pop();
+    }
+}
+
+/*
+ * Raw dump (z): npages NAND pages from page on with their spare area, as
+ * READSPARE (page address, page count) returns them, written in the
+ * container of rkraw.h. npages 0 is up to the end of the flash.
+ */
+static void raw_dump(uint32_t page, uint32_t npages) {
+    struct rkraw_header hdr;
+    uint8_t head[RKRAW_HEADER_SIZE];
+    uint32_t total;
+
+    read_flash_size();
+    if (!flash_info.page_size || !flash_info.block_size)
+        fatal("the flash reports no page or block size\n");
+    if (flash_info.page_size * (512 + RKRAW_SPARE) > RKFT_BUFSIZE)
+        fatal("pages of %u sectors are not supported\n", flash_info.page_size);
+    total = flash_size / flash_info.page_size;
+    if (page >= total)
+        fatal("page 0x%x is past the end of the flash (0x%x pages)\n",
+              page, total);
+    if (!npages || npages > total - page)
+        npages = total - page;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, RKRAW_MAGIC, sizeof(hdr.magic));
+    hdr.header_size     = RKRAW_HEADER_SIZE;
+    hdr.first_page      = page;
+    hdr.npages          = npages;
+    hdr.page_sectors    = flash_info.page_size;
+    hdr.page_bytes      = flash_info.page_size * (512 + RKRAW_SPARE);
+    hdr.block_pages     = flash_info.block_size / flash_info.page_size;
+    hdr.flash_size      = flash_size;
+    hdr.ecc_bits        = flash_info.ecc_bits;
+    hdr.access_time     = flash_info.access_time;
+    hdr.manufacturer_id = flash_info.manufacturer_id;
+    hdr.chip_select     = flash_info.chip_select;
+
+    send_cmd(RKFT_CMD_READFLASHID, 0, 0);
+    recv_buf(5);
+    recv_res();
+    memcpy(hdr.flash_id, buf, sizeof(hdr.flash_id));
+
+    memset(head, 0, sizeof(head));
+    memcpy(head, &hdr, sizeof(hdr));
+    if (write(1, head, sizeof(head)) <= 0)
+        fatal("Write error! Disk full?\n");
+
+    info("dumping 0x%x pages of %u bytes from page 0x%x\n", npages,
+         hdr.page_bytes, page);
+    prog.total = (uint64_t)npages * hdr.page_bytes;
+    queue_rw('z', page, npages);
+}
+
+/* m, M and B take physical addresses, the loader offsets from the SDRAM base */
+static uint32_t sdram_base(void) {
+    struct libusb_device_descriptor desc;
+    const struct t_pid *pid;
+
+    if (libusb_get_device_descriptor(libusb_get_device(h), &desc) ||
+            !(pid = rkusb_find_pid(desc.idVendor, desc.idProduct)))
+        fatal("cannot tell the SDRAM base of this device\n");
+    return pid->sdram_base;
+}
+
+/*
+ * The parameters, with initrd= added to the CMDLINE if there is an initrd,
+ * signed. The address is only known once the device is.
+ */
+static uint8_t *boot_param(struct job *j, uint32_t base, uint32_t *len) {
+    const char *text = (const char *)j->boot[1];
+    const char *cl, *end = text + j->boot_len[1];
+    char arg[48];
+    uint8_t *p;
+    size_t at, n = 0;
+
+    /* a signed parameter file is taken apart first */
+    if (j->boot_len[1] >= 12 && !memcmp(text, "PARM", 4) &&
+            GET32LE(j->boot[1] + 4) == j->boot_len[1] - 12) {
+        text += 8;
+        end  -= 4;
+    }
+
+    if (j->boot[2]) {
+        n = snprintf(arg, sizeof(arg), " initrd=0x%08x,0x%x",
+                     base + RKFT_BOOT_INITRD, j->boot_len[2]);
+        for (cl = text; cl + 8 <= end && memcmp(cl, "CMDLINE:", 8); cl++)
+            ;
+        if (cl + 8 > end)
+            fatal("the parameter file has no CMDLINE for the initrd\n");
+        for (at = cl - text; text + at < end && !strchr("\r\n", text[at]); at++)
+            ;
+    } else {
+        at = end - text;
+    }
+
+    *len = end - text + n;
+    if (*len > MAX_PARAM_LENGTH)
+        fatal("Bad parameter length!\n");
+    if (!(p = malloc(*len)))
+        fatal("out of memory\n");
+    memcpy(p, text, at);
+    memcpy(p + at, arg, n);
+    memcpy(p + at + n, text + at, end - text - at);
+    return sign_image("PARM", p, len);
+}
+
+/* Kernel, parameters and initrd through the queue, then ExecuteSDRAM */
+static void boot_kernel(struct job *j) {
+    static const char *const names[3] = { "kernel", "parameters", "initrd" };
+    const uint32_t at[3] = { RKFT_BOOT_KERNEL, RKFT_BOOT_PARM, RKFT_BOOT_INITRD };
+    uint32_t base = sdram_base(), len[3];
+    uint8_t *data[3];
+    int i;
+
+    data[0] = j->boot[0];
+    len[0]  = j->boot_len[0];
+    data[1] = j->tmp[0] = boot_param(j, base, &len[1]);
+    data[2] = j->boot[2];
+    len[2]  = j->boot_len[2];
+
+    prog.total = (uint64_t)len[0] + len[1] + len[2];
+    for (i = 0; i < 3; i++) {
+        if (!data[i]) continue;
+        info("%s: %u bytes at 0x%08x\n", names[i], len[i], base + at[i]);
+        in_back     = data[i];
+        in_back_len = len[i];
+        in_back_pos = 0;
+        queue_rw('M', at[i], len[i]);
+    }
+    in_back = in_head;
+    in_back_len = in_back_pos = 0;
+
+    info("booting kernel...\n");
+    send_exec(at[0], at[1]);
+    recv_res();
+}
+
+static int loader_ready;    /* TESTUNITREADY done on this handle */
+
+static void run_job(struct job *j) {
+    struct rkupload upload;
+    struct rkimage *image = &j->image;
+    char action = j->action;
+    int offset = j->offset, size = j->size;
+    uint8_t flag = j->flag;
+    char *partname = j->partname;
+
+    switch(action) {
+    case 'l':
+    case 'L':
+        progress_start(action, 0, image->size);
+        info("load %s\n", action == 'l' ? "DDR init" : "USB loader");
+        report_arrival();
+        if (rkupload_run(c, h, image, &upload) < 0)
+            fatal("upload failed: %s\n", libusb_error_name(upload.status));
+        info("%lu bytes in %d transfers, prepare %.1f ms, "
+             "transfer %.1f ms (%.1f KiB/s)\n",
+             (unsigned long)image->size + 2, image->nslots, image->t_load * 1000,
+             (upload.t_end - upload.t_start) * 1000, rkupload_rate(&upload));
+        prog.done = image->size;
+        rkimage_free(image);
+        goto exit;
+    }
+
+    /* Initialize bootloader interface */
 
-            if (write(1, buf, RKFT_IDB_BLOCKSIZE * sizeRead) <= 0)
+    report_arrival();
+    if (!loader_ready) {
+        send_cmd(RKFT_CMD_TESTUNITREADY, 0, 0);
+        recv_res();
+        usleep(20*1000);
+        loader_ready = 1;
+    }
+
+    /* Look up partition name */
+    if (partname) {
+        struct partition *part;
+
+        info("working with partition: %s\n", partname);
+
+        if (read_parttab() < 0)
+            goto exit;
+        if (!(part = find_partition(partname))) {
+            info("Error: Partition '%s' not found.\n", partname);
+            goto exit;
+        }
+
+        offset = part->offset;
+        info("found offset: %#010x\n", offset);
+        if (part->grow) {
+            size = read_flash_size() - offset;
+            info("partition extends up to the end of NAND (size: 0x%08x).\n", size);
+        } else {
+            size = part->size;
+            info("found size: %#010x\n", size);
+        }
+    }
+
+    progress_start(action, offset,
+                   strchr("rwe", action) ? (uint64_t)size * 512 :
+                   strchr("mM", action)  ? (uint64_t)size :
+                   strchr("ij", action)  ? (uint64_t)size * RKFT_IDB_BLOCKSIZE :
+                   0);
+
+    /* Writes to the parameter area make the cached copy stale */
+    if (action == 'P' || action == 'b' ||
+            ((action == 'w' || action == 'e') && offset < 0x2000))
+        param_valid = 0;
+    if (action == 'b')
+        flash_size = 0;
+
+    /* Check and execute command */
+
+    switch(action) {
+    case 'b':   /* Reboot device */
+        info("rebooting device...\n");
+		printf("flag: %d\n", flag);
+        send_reset(flag);
+        recv_res();
+        break;
+    case 'r':   /* Read FLASH */
+        if (skip_bad)
+            fatal("--skip-bad only works with rawdump\n");
+        if (zip_method &&
+                rkzip_open(&zip, 1, zip_method, zip_level, zip_threads) < 0)
+            fatal("cannot start compression: %s\n", strerror(errno));
+        if (journal_path) {
+            uint32_t done = journal_open(action, offset, size);
+            offset += done;
+            size   -= done;
+        }
+        queue_rw(action, offset, size);
+        if (zip_method) {
+            if (rkzip_close(&zip) < 0)
                 fatal("Write error! Disk full?\n");
+            info("compressed %llu to %llu bytes with %d threads\n",
+                 (unsigned long long)zip.bytes_in,
+                 (unsigned long long)zip.bytes_out, zip.nthreads);
+        }
+        journal_close();
+        break;
+    case 'w':   /* Write FLASH */
+        if (skip_bad)
+            fatal("--skip-bad only works with rawdump\n");
+        /* compressed input is recognized and unpacked on other threads */
+        if (rkzip_reader_open(&unzip, 0, zip_threads) < 0)
+            fatal("read error: %s\n", unzip.errmsg);
+        if (unzip.method)
+            info("reading %s compressed input\n", rkzip_names[unzip.method]);
+
+        /* look at the start for a sparse image header, then push it back */
+        ssize_t got = rkzip_read(&unzip, in_head, SPARSE_HEADER_LEN);
+        if (got < 0)
+            fatal("read error: %s\n", unzip.errmsg);
+        in_back_len = got;
+        in_back_pos = 0;
+        if (in_back_len == SPARSE_HEADER_LEN &&
+                GET32LE(in_back) == SPARSE_MAGIC) {
+            if (journal_path)
+                fatal("--journal does not work with sparse images\n");
+            in_back_pos = in_back_len;
+            write_sparse(offset, size, in_back);
+            rkzip_reader_close(&unzip);
+            break;
+        }
+        if (journal_path) {
+            uint32_t done = journal_open(action, offset, size);
+            offset += done;
+            size   -= done;
+        }
+        queue_rw(action, offset, size);
+        rkzip_reader_close(&unzip);
+        journal_close();
+        break;
+    case 'x':   /* Scan for bad blocks */
+        scan_bad_blocks();
+        break;
+    case 'z':   /* Raw dump with spare */
+        raw_dump(offset, size);
+        break;
+    case 't':   /* List partitions */
+        if (read_parttab() < 0)
+            break;
+        for (int i = 0; i < parttab.n; i++) {
+            struct partition *part = &parttab.part[i];
+            printf("%-16s %#010x %#010x%s\n", part->name, part->offset,
+                   part->grow ? read_flash_size() - part->offset : part->size,
+                   part->grow ? " (grows)" : "");
+        }
+        break;
+    case 'p':   /* Retreive parameters */
+        info("reading parameters at offset 0x%08x\n", offset);
 
-            offset += sizeRead;
-            size -= sizeRead;
+        /* length and CRC are checked, per copy */
+        if (read_params() < 0)
+            fatal("Bad parameters!\n");
+        size = GET32LE(buf + 4);
+        info("size:  0x%08x\n", size);
+
+        if (write(1, &buf[8], size) <= 0)
+            fatal("Write error! Disk full?\n");
+        break;
+    case 'P':   /* Write parameters */
+        {
+            uint8_t *param, *copies;
+            uint32_t nsectors, len;
+            int sizeRead, n, i, bad = 0;
+
+            /* Header */
+            memcpy(buf, "PARM", 4);
+
+            /* Content, with length and CRC in the block read_params() reads */
+            for (sizeRead = 0; sizeRead <= RKFT_BLOCKSIZE - 12; sizeRead += n) {
+                if ((n = read(0, buf + 8 + sizeRead,
+                              RKFT_BLOCKSIZE - 11 - sizeRead)) < 0) {
+                    info("read error: %s\n", strerror(errno));
+                    goto exit;
+                }
+                if (!n) break;
+            }
+            if (sizeRead > RKFT_BLOCKSIZE - 12)
+                fatal("parameters longer than %d bytes\n", RKFT_BLOCKSIZE - 12);
+
+            /* Length */
+            PUT32LE(buf + 4, sizeRead);
+
+            /* CRC */
+            PUT32LE(buf + 8 + sizeRead, rkcrc32(0, buf + 8, sizeRead));
+
+            /* Only the sectors it takes go out, the rest of the last zeroed */
+            nsectors = (12 + sizeRead + 511) / 512;
+            len = nsectors * 512;
+            memset(buf + 12 + sizeRead, 0, len - 12 - sizeRead);
+            if (!(param = j->tmp[0] = malloc(len)))
+                fatal("out of memory\n");
+            memcpy(param, buf, len);
+
+            prog.total = (uint64_t)len * RKFT_PARAM_COPIES * (verify ? 2 : 1);
+            param_copies(1, param, nsectors);
+            progress("writing", RKFT_PARAM_COPIES * RKFT_PARAM_STRIDE,
+                     (uint64_t)len * RKFT_PARAM_COPIES);
+            progress_done("writing");
+
+            if (verify) {
+                if (!(copies = j->tmp[1] =
+                            malloc((size_t)len * RKFT_PARAM_COPIES)))
+                    fatal("out of memory\n");
+                param_copies(0, copies, nsectors);
+                progress("reading", RKFT_PARAM_COPIES * RKFT_PARAM_STRIDE,
+                         (uint64_t)len * RKFT_PARAM_COPIES);
+                progress_done("reading");
+                for (i = 0; i < RKFT_PARAM_COPIES; i++)
+                    if (memcmp(copies + (size_t)i * len, param, 12 + sizeRead)) {
+                        info("copy %d at 0x%04x does not read back\n", i,
+                             i * RKFT_PARAM_STRIDE);
+                        bad++;
+                    }
+                if (bad)
+                    fatal("%d of %d parameter copies bad\n", bad,
+                          RKFT_PARAM_COPIES);
+                info("%d parameter copies verified\n", RKFT_PARAM_COPIES);
+            }
         }
-        fprintf(stderr, "... Done!\n");
+        break;
+    case 'm':   /* Read RAM */
+        queue_rw(action, offset - sdram_base(), size);
+        break;
+    case 'M':   /* Write RAM */
+        if (rkzip_reader_open(&unzip, 0, zip_threads) < 0)
+            fatal("read error: %s\n", unzip.errmsg);
+        queue_rw(action, offset - sdram_base(), size);
+        rkzip_reader_close(&unzip);
+        break;
+    case 'k':   /* Boot a kernel from SDRAM */
+        boot_kernel(j);
+        break;
+    case 'B':   /* Exec RAM */
+        info("booting kernel...\n");
+        send_exec(offset - sdram_base(), size - sdram_base());
+        recv_res();
+        break;
+    case 'i':   /* Read IDB */
+        queue_rw(action, offset, size);
+        break;
+    case 'j':   /* Write IDB */
+        if (rkzip_reader_open(&unzip, 0, zip_threads) < 0)
+            fatal("read error: %s\n", unzip.errmsg);
+        queue_rw(action, offset, size);
+        rkzip_reader_close(&unzip);
         break;
     case 'e':   /* Erase flash */
         memset(buf, 0xff, RKFT_BLOCKSIZE);
         while (size > 0) {
-            infocr("erasing flash memory at offset 0x%08x", offset);
-
             send_cmd(RKFT_CMD_WRITELBA, offset, RKFT_OFF_INCR);
             send_buf(RKFT_BLOCKSIZE);
             recv_res();
 
             offset += RKFT_OFF_INCR;
             size   -= RKFT_OFF_INCR;
+            progress("erasing", offset, RKFT_BLOCKSIZE);
         }
-        fprintf(stderr, "... Done!\n");
+        progress_done("erasing");
         break;
     case 'v':   /* Read Chip Version */
         send_cmd(RKFT_CMD_READCHIPINFO, 0, 0);
@@ -704,6 +2649,554 @@ action:
     }
 
 exit:
+    progress_end("ok");
+}
+
+/*
+ * Batch mode
+ *
+ * Several steps run in order over one claimed interface, either read from
+ * a job file given with --jobs=file (one step per line, '#' starts a
+ * comment) or given on the command line separated by '+'. A step is the
+ * usual command, optionally followed by <file and >file to take its input
+ * from or send its output to a file.
+ */
+
+struct step {
+    struct job job;
+    int argc;
+    char **argv;
+    char *in, *out;
+    int infd;
+    double t;
+};
+
+static struct step *steps;
+static int nsteps;
+static char *jobs_text;         /* job file, tokens point into it */
+static char **jobs_argv;
+static int saved_fds[2] = { -1, -1 };
+
+static void add_step(int argc, char **argv) {
+    struct step *st;
+    int i, n = 0;
+
+    if (!argc) usage();
+    if (!(steps = realloc(steps, (nsteps + 1) * sizeof(*steps))))
+        fatal("out of memory\n");
+    st = &steps[nsteps++];
+    memset(st, 0, sizeof(*st));
+    st->infd = -1;
+
+    /* pick out the redirections, the rest is the command */
+    for (i = 0; i < argc; i++) {
+        char **f = argv[i][0] == '<' ? &st->in :
+                   argv[i][0] == '>' ? &st->out : NULL;
+        if (!f) {
+            argv[n++] = argv[i];
+            continue;
+        }
+        if (argv[i][1])
+            *f = argv[i] + 1;
+        else if (++i < argc)
+            *f = argv[i];
+        else
+            usage();
+    }
+    st->argc = n;
+    st->argv = argv;
+
+    /* l and L read their image now, so the input has to be there already */
+    if (st->in) {
+        if ((st->infd = open(st->in, O_RDONLY)) < 0)
+            fatal("%s: %s\n", st->in, strerror(errno));
+        if (saved_fds[0] < 0) saved_fds[0] = dup(0);
+        dup2(st->infd, 0);
+    }
+    parse_job(&st->job, st->argc, st->argv);
+    if (st->in) dup2(saved_fds[0], 0);
+}
+
+static void read_jobs(const char *path) {
+    size_t len = 0, alloc = 0;
+    int fd, n = 0, argc = 0, start = 0;
+    ssize_t r;
+    char *p;
+
+    if (!strcmp(path, "-"))
+        fd = 0;
+    else if ((fd = open(path, O_RDONLY)) < 0)
+        fatal("%s: %s\n", path, strerror(errno));
+
+    do {
+        if (len + 4096 + 1 > alloc &&
+                !(jobs_text = realloc(jobs_text, alloc += 65536)))
+            fatal("out of memory\n");
+        if ((r = read(fd, jobs_text + len, 4096)) < 0)
+            fatal("%s: %s\n", path, strerror(errno));
+        len += r;
+    } while (r > 0);
+    jobs_text[len] = 0;
+    if (fd) close(fd);
+
+    /* every token ends up in jobs_argv, at most one per two characters */
+    if (!(jobs_argv = malloc((len / 2 + 2) * sizeof(char *))))
+        fatal("out of memory\n");
+
+    for (p = jobs_text; *p; ) {
+        if (*p == '#') {
+            while (*p && *p != '\n') *p++ = 0;
+        } else if (*p == '\n') {
+            *p++ = 0;
+            if (argc) add_step(argc, jobs_argv + start);
+            start = n;
+            argc = 0;
+        } else if (*p == ' ' || *p == '\t' || *p == '\r') {
+            *p++ = 0;
+        } else {
+            jobs_argv[n++] = p;
+            argc++;
+            while (*p && !strchr(" \t\r\n#", *p)) p++;
+        }
+    }
+    if (argc) add_step(argc, jobs_argv + start);
+}
+
+static void parse_steps(int argc, char **argv) {
+    int i, start = 0;
+
+    if (jobs_path) {
+        if (argc) usage();
+        read_jobs(jobs_path);
+    } else {
+        for (i = 0; i <= argc; i++) {
+            if (i < argc && strcmp(argv[i], "+")) continue;
+            add_step(i - start, argv + start);
+            start = i + 1;
+        }
+    }
+    if (!nsteps) usage();
+
+    /* the device is gone after these */
+    for (i = 0; i < nsteps - 1; i++)
+        if (strchr("bLk", steps[i].job.action))
+            fatal("'%s' has to be the last step\n",
+                  steps[i].job.action == 'k' ? "boot" :
+                  steps[i].job.action == 'b' ? "b" : "L");
+}
+
+static void run_steps(void) {
+    double t;
+    int i, fd;
+
+    for (i = 0; i < nsteps; i++) {
+        struct step *st = &steps[i];
+
+        if (st->infd >= 0) {
+            if (saved_fds[0] < 0) saved_fds[0] = dup(0);
+            dup2(st->infd, 0);
+        }
+        if (st->out) {
+            if ((fd = open(st->out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+                fatal("%s: %s\n", st->out, strerror(errno));
+            if (saved_fds[1] < 0) saved_fds[1] = dup(1);
+            dup2(fd, 1);
+            close(fd);
+        }
+
+        t = rk_now();
+        run_job(&st->job);
+        st->t = rk_now() - t;
+
+        if (st->infd >= 0) {
+            dup2(saved_fds[0], 0);
+            close(st->infd);
+            st->infd = -1;
+        }
+        if (st->out) dup2(saved_fds[1], 1);
+    }
+
+    if (nsteps < 2) return;
+    for (t = 0, i = 0; i < nsteps; i++) {
+        char line[256];
+        int j, n = 0;
+        for (j = 0; j < steps[i].argc && n < (int)sizeof(line); j++)
+            n += snprintf(line + n, sizeof(line) - n, "%s%s",
+                          j ? " " : "", steps[i].argv[j]);
+        info("step %d: %-32s %9.1f ms\n", i + 1, line, steps[i].t * 1000);
+        t += steps[i].t;
+    }
+    info("%d steps in %.1f ms\n", nsteps, t * 1000);
+}
+
+static void free_steps(void) {
+    int i;
+
+    for (i = 0; i < 2; i++)
+        if (saved_fds[i] >= 0) {
+            dup2(saved_fds[i], i);
+            close(saved_fds[i]);
+            saved_fds[i] = -1;
+        }
+    for (i = 0; i < nsteps; i++) {
+        if (steps[i].infd >= 0) close(steps[i].infd);
+        job_free(&steps[i].job);
+    }
+    free(steps);
+    free(jobs_text);
+    free(jobs_argv);
+    steps = NULL;
+    jobs_text = NULL;
+    jobs_argv = NULL;
+    nsteps = 0;
+}
+
+#ifndef _WIN32
+
+/*
+ * Daemon mode
+ *
+ * rkflashtool --daemon=path keeps the libusb context and the claimed
+ * devices open and runs jobs sent by clients over a Unix socket. A client
+ * is rkflashtool itself, run with --socket=path or with RKFLASHTOOL_SOCKET
+ * set in the environment, and takes the usual command line. It sends its
+ * working directory, arguments and stdin/stdout/stderr to the daemon and
+ * exits with the status of the job.
+ *
+ * A device stays claimed until it is rebooted, disappears or a job on it
+ * fails, so later jobs skip opening, claiming and TESTUNITREADY.
+ */
+
+struct session {
+    struct session *next;
+    char port[32], serial[128];
+    libusb_device_handle *h;
+    int ready;
+};
+
+static struct session *sessions;
+
+static void session_close(struct session *s) {
+    if (!s->h) return;
+    libusb_release_interface(s->h, 0);
+    libusb_close(s->h);
+    s->h = NULL;
+}
+
+static struct session *session_get(const char *port) {
+    struct session *s;
+
+    for (s = sessions; s; s = s->next)
+        if (!strcmp(s->port, port)) return s;
+    if (!(s = calloc(1, sizeof(*s)))) fatal("out of memory\n");
+    snprintf(s->port, sizeof(s->port), "%s", port);
+    s->next = sessions;
+    sessions = s;
+    return s;
+}
+
+static struct session *session_open(void) {
+    struct libusb_device_descriptor desc;
+    struct rkusb_dev *list = NULL;
+    struct session *s = NULL;
+    char port[32];
+    int i, n;
+
+    if ((n = rkusb_scan(c, &list)) < 0)
+        fatal("cannot list devices: %s\n", libusb_error_name(n));
+
+    /* prefer a device which is still claimed from an earlier job */
+    for (i = 0; i < n && !s; i++) {
+        struct session *t;
+        if (sel_port && strcmp(list[i].port, sel_port)) continue;
+        for (t = sessions; t; t = t->next)
+            if (t->h && libusb_get_device(t->h) == list[i].dev &&
+                    (!sel_serial || !strcmp(t->serial, sel_serial)))
+                s = t;
+    }
+
+    for (i = 0; i < n && !s; i++) {
+        if (sel_port && strcmp(list[i].port, sel_port)) continue;
+        if ((h = open_device(list[i].dev, 0))) {
+            info("Detected %s at %s...\n", list[i].pid->name, list[i].port);
+            s = session_get(list[i].port);
+            session_close(s);       /* stale, the device re-enumerated */
+            s->h = h;
+            s->ready = 0;
+        }
+    }
+    rkusb_free_scan(list, n);
+
+    if (!s && wait >= 0 && (h = wait_device(wait))) {
+        rkusb_port_name(libusb_get_device(h), port, sizeof(port));
+        s = session_get(port);
+        session_close(s);
+        s->h = h;
+        s->ready = 0;
+    }
+    if (!s) fatal("cannot open device\n");
+
+    h = s->h;
+    if (!s->ready) {
+        s->serial[0] = 0;
+        if (!libusb_get_device_descriptor(libusb_get_device(h), &desc) &&
+                desc.iSerialNumber)
+            libusb_get_string_descriptor_ascii(h, desc.iSerialNumber,
+                    (unsigned char *)s->serial, sizeof(s->serial));
+        claim_device();
+    }
+    return s;
+}
+
+static int daemon_job(int argc, char **argv) {
+    jmp_buf jb;
+    struct session *volatile s = NULL;
+    volatile int status = 1;
+    volatile int reboot = 0;
+
+    wait = -1;
+    sel_port = sel_serial = NULL;
+    daemon_path = socket_path = jobs_path = NULL;
+    zip_method = zip_threads = erase_skipped = resume = skip_bad = verify = 0;
+    journal_path = json_path = trace_path = NULL;
+    depth = 8;
+    t_arrival = 0;
+    param_valid = flash_size = 0;
+
+    fatal_jmp = &jb;
+    if (setjmp(jb)) goto out;
+
+    parse_options(&argc, &argv);
+    if (daemon_path || socket_path) usage();
+    events_open(json_path);
+    parse_steps(argc, argv);
+    reboot = strchr("blLk", steps[nsteps - 1].job.action) != NULL;
+
+    s = session_open();
+    loader_ready = s->ready;
+    trace_open(trace_path);
+    run_steps();
+    status = 0;
+
+out:
+    fatal_jmp = NULL;
+    if (q_count) {
+        queue_cancel();
+        q_count = 0;
+    }
+    if (zip.threads) rkzip_close(&zip);
+    rkzip_reader_close(&unzip);
+    journal_close();
+    free_steps();
+    events_close();
+    trace_close();
+    if (s) {
+        s->ready = loader_ready;
+        /* the device goes away on reboot, and is suspect after an error */
+        if (status || reboot)
+            session_close(s);
+    }
+    return status;
+}
+
+static int recv_request(int conn, int fds[3], char **data) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    uint32_t len;
+    ssize_t n;
+    size_t got;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (recvmsg(conn, &msg, 0) != sizeof(len)) return -1;
+    cm = CMSG_FIRSTHDR(&msg);
+    if (!cm || cm->cmsg_type != SCM_RIGHTS ||
+            cm->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        return -1;
+    memcpy(fds, CMSG_DATA(cm), 3 * sizeof(int));
+
+    if (len > 1024*1024 || !(*data = malloc(len + 1))) return -1;
+    for (got = 0; got < len; got += n)
+        if ((n = read(conn, *data + got, len - got)) <= 0) return -1;
+    (*data)[len] = 0;
+    return len;
+}
+
+static void run_daemon(const char *path) {
+    struct sockaddr_un sa;
+    int srv, conn, fds[3], saved[3], i, argc, len, status;
+    char *data, *p, *argv[256];
+    mode_t mask;
+
+    if (libusb_init(&c)) fatal("cannot init libusb\n");
+    libusb_set_debug(c, 3);
+
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < 3; i++) saved[i] = dup(i);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) fatal("socket path too long\n");
+    strcpy(sa.sun_path, path);
+    unlink(path);
+    /* only the owner may send jobs: they can write any claimed device */
+    if ((srv = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        fatal("%s: %s\n", path, strerror(errno));
+    mask = umask(077);
+    i = bind(srv, (struct sockaddr *)&sa, sizeof(sa));
+    umask(mask);
+    if (i < 0 || listen(srv, 16) < 0)
+        fatal("%s: %s\n", path, strerror(errno));
+    info("listening on %s\n", path);
+
+    for (;;) {
+        if ((conn = accept(srv, NULL, NULL)) < 0) {
+            if (errno == EINTR) continue;
+            fatal("accept: %s\n", strerror(errno));
+        }
+
+        data = NULL;
+        if ((len = recv_request(conn, fds, &data)) < 0) {
+            info("bad request\n");
+            free(data);
+            close(conn);
+            continue;
+        }
+
+        /* working directory, then the arguments, all NUL terminated */
+        for (argc = 0, p = data; p < data + len && argc < 256; p += strlen(p) + 1)
+            argv[argc++] = p;
+
+        for (i = 0; i < 3; i++) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+
+        if (argc && chdir(argv[0]) == 0)
+            status = daemon_job(argc - 1, argv + 1);
+        else
+            status = 1;
+
+        fflush(stdout);
+        fflush(stderr);
+        for (i = 0; i < 3; i++) dup2(saved[i], i);
+
+        if (write(conn, &status, sizeof(status)) != sizeof(status))
+            info("client went away\n");
+        close(conn);
+        free(data);
+    }
+}
+
+static int run_client(const char *path, int argc, char **argv) {
+    struct sockaddr_un sa;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    char cbuf[CMSG_SPACE(3 * sizeof(int))], cwd[4096], *data, *p;
+    int s, i, fds[3] = { 0, 1, 2 }, status;
+    uint32_t len;
+
+    if (!getcwd(cwd, sizeof(cwd))) fatal("getcwd: %s\n", strerror(errno));
+    len = strlen(cwd) + 1;
+    for (i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+    if (!(data = malloc(len))) fatal("out of memory\n");
+    p = data;
+    strcpy(p, cwd);
+    p += strlen(p) + 1;
+    for (i = 0; i < argc; i++) {
+        strcpy(p, argv[i]);
+        p += strlen(p) + 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            connect(s, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+        fatal("%s: %s\n", path, strerror(errno));
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    if (sendmsg(s, &msg, 0) != sizeof(len) || write(s, data, len) != (ssize_t)len)
+        fatal("%s: %s\n", path, strerror(errno));
+    free(data);
+
+    if (read(s, &status, sizeof(status)) != sizeof(status))
+        fatal("daemon closed the connection\n");
+    close(s);
+    return status;
+}
+
+#endif /* !_WIN32 */
+
+int main(int argc, char **argv) {
+    char **args;
+    int nargs;
+
+    NEXT;
+    args = argv;
+    nargs = argc;
+
+    parse_options(&argc, &argv);
+
+#ifndef _WIN32
+    if (daemon_path) {
+        if (argc) usage();
+        run_daemon(daemon_path);
+    }
+    if (!socket_path) socket_path = getenv("RKFLASHTOOL_SOCKET");
+    if (socket_path && *socket_path) {
+        /* strip --socket, everything else goes to the daemon as is */
+        int i, n = 0;
+        for (i = 0; i < nargs; i++)
+            if (strncmp(args[i], "--socket=", 9)) args[n++] = args[i];
+        return run_client(socket_path, n, args);
+    }
+#else
+    if (daemon_path || socket_path)
+        fatal("daemon mode is not available on this platform\n");
+#endif
+
+    events_open(json_path);
+    info("rkflashtool v%d.%d\n", RKFLASHTOOL_VERSION_MAJOR,
+                                 RKFLASHTOOL_VERSION_MINOR);
+
+    parse_steps(argc, argv);
+
+    /* Initialize libusb */
+
+    if (libusb_init(&c)) fatal("cannot init libusb\n");
+
+    libusb_set_debug(c, 3);
+
+    h = wait < 0 ? open_first(0) : wait_device(wait);
+    if (!h) fatal("cannot open device\n");
+
+    claim_device();
+    trace_open(trace_path);
+    run_steps();
+    trace_close();
+
     /* Disconnect and close all interfaces */
 
     libusb_release_interface(h, 0);
@@ -5,3 +5,9 @@
         (x)[2] = ((y)>>16) & 0xff; \
         (x)[3] = ((y)>>24) & 0xff; \
     } while (0)
+
+#define GET16LE(x) ((uint16_t)((x)[0] | (x)[1] << 8))
+
+#define GET32LE(x) \
+    ((uint32_t)(x)[0] | (uint32_t)(x)[1] << 8 | \
+     (uint32_t)(x)[2] << 16 | (uint32_t)(x)[3] << 24)
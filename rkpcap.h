@@ -0,0 +1,470 @@
+/* rkpcap.h - pcap files of Rockchip USB traffic
+ *
+ * Copyright (C) 2010-2014 by Ivo van Poorten, Fukaumi Naoki, Guenter Knauf,
+ *                            Ulrich Prinz, Steve Wilson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RKPCAP_H_
+#define _RKPCAP_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * File format
+ *
+ * A pcap file is a file header and records, each a record header and the
+ * captured bytes. With RKPCAP_MAGIC_NSEC the second field of a record
+ * header counts nanoseconds. Files written on a machine of the other byte
+ * order start with a swapped magic.
+ */
+
+#define RKPCAP_MAGIC            0xa1b2c3d4
+#define RKPCAP_MAGIC_NSEC       0xa1b23c4d
+
+#define RKPCAP_DLT_USB_LINUX    189     /* usbmon, 48 byte header */
+#define RKPCAP_DLT_USB_MMAPPED  220     /* usbmon, 64 byte header */
+#define RKPCAP_DLT_USBPCAP      249     /* Windows USBPcap */
+
+#define RKPCAP_SNAPLEN          0x40000
+
+struct rkpcap_file_header {
+    uint32_t magic;
+    uint16_t version_major, version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs, snaplen, linktype;
+};
+
+struct rkpcap_rec_header {
+    uint32_t ts_sec, ts_frac;           /* usec or nsec, see the magic */
+    uint32_t incl_len, orig_len;
+};
+
+/*
+ * USBPcap: one record when a transfer is submitted (info 0) and one when
+ * it completes (info 1), with the same irp_id. OUT data is in the first,
+ * IN data in the second. The status is a USBD_STATUS code.
+ */
+
+#define RKPCAP_USBPCAP_LEN      27
+#define RKPCAP_INFO_PDO_TO_FDO  1       /* completion */
+#define RKPCAP_TRANSFER_BULK    3
+#define RKPCAP_URB_BULK         0x0009
+#define RKPCAP_USBD_STALL       0xc0000004
+#define RKPCAP_USBD_CANCELED    0xc0010000
+#define RKPCAP_USBD_ERROR       0xc0000011  /* anything else, XACT_ERROR */
+
+#pragma pack(push, 1)
+struct rkpcap_usbpcap {
+    uint16_t header_len;
+    uint64_t irp_id;
+    uint32_t status;
+    uint16_t function;
+    uint8_t  info;
+    uint16_t bus, device;
+    uint8_t  endpoint, transfer;
+    uint32_t data_len;
+};
+
+/* usbmon, the first 48 bytes are the same for both link types */
+struct rkpcap_usbmon {
+    uint64_t id;
+    uint8_t  type;                      /* 'S'ubmit, 'C'omplete, 'E'rror */
+    uint8_t  xfer_type;                 /* 3 bulk */
+    uint8_t  epnum, devnum;
+    uint16_t busnum;
+    int8_t   flag_setup, flag_data;
+    int64_t  ts_sec;
+    int32_t  ts_usec;
+    int32_t  status;                    /* -errno */
+    uint32_t urb_len, data_len;
+    uint8_t  setup[8];
+};
+#pragma pack(pop)
+
+/*
+ * Command codes of the Rockchip loader (CBW bytes 12..15), doc/protocol.txt,
+ * and whether they only read. The direction bit does not say: WriteSpare
+ * has it set.
+ */
+static const struct {
+    uint32_t command;
+    const char *name;
+    int readonly;
+} rkpcap_commands[] = {
+    { 0x80000600, "TestUnitReady",   1 },
+    { 0x80000601, "ReadFlashID",     1 },
+    { 0x8000061a, "ReadFlashInfo",   1 },
+    { 0x8000061b, "ReadChipInfo",    1 },
+    { 0x80000620, "ReadEfuse",       1 },
+    { 0x00000602, "SetDeviceInfo",   0 },
+    { 0x00000616, "EraseSystemDisk", 0 },
+    { 0x0000061e, "SetResetFlag",    0 },
+    { 0x000006ff, "ResetDevice",     0 },
+    { 0x80000a03, "TestBadBlock",    1 },
+    { 0x80000a04, "ReadSector",      1 },
+    { 0x80000a14, "ReadLBA",         1 },
+    { 0x80000a17, "ReadSDRAM",       1 },
+    { 0x00000a05, "WriteSector",     0 },
+    { 0x00000a06, "EraseSectors",    0 },
+    { 0x00000a15, "WriteLBA",        0 },
+    { 0x00000a18, "WriteSDRAM",      0 },
+    { 0x00000a19, "ExecuteSDRAM",    0 },
+    { 0x00000a1f, "WriteEfuse",      0 },
+    { 0x80001007, "WriteSpare",      0 },
+    { 0x80001008, "ReadSpare",       1 },
+    { 0x0000001c, "LowerFormat",     0 },
+    { 0x00000030, "WriteNKB",        0 },
+    { 0, NULL, 0 },
+};
+
+/* NULL for a command not in the list */
+static inline const char *rkpcap_command_name(uint32_t command) {
+    int i;
+
+    for (i = 0; rkpcap_commands[i].name; i++)
+        if (rkpcap_commands[i].command == command)
+            return rkpcap_commands[i].name;
+    return NULL;
+}
+
+/* 0 for a command that changes the device, or one not in the list */
+static inline int rkpcap_command_readonly(uint32_t command) {
+    int i;
+
+    for (i = 0; rkpcap_commands[i].name; i++)
+        if (rkpcap_commands[i].command == command)
+            return rkpcap_commands[i].readonly;
+    return 0;
+}
+
+/*
+ * Reading
+ *
+ * rkpcap_next() reads a capture one record at a time and turns its
+ * USBPcap or usbmon header into a struct rkpcap_rec. USBPcap headers are
+ * little endian, usbmon headers are in the byte order of the machine that
+ * captured them, as is the file header.
+ */
+
+#define RKPCAP_TRANSFER_CONTROL 2
+
+struct rkpcap_rec {
+    double t;
+    uint64_t id;                        /* the same at both ends of a transfer */
+    int done;                           /* completion, else submission */
+    int error;
+    uint8_t ep, transfer;
+    uint32_t length;                    /* requested, or done at completion */
+    const uint8_t *data;                /* what was captured of it */
+    uint32_t len;
+};
+
+struct rkpcap_reader {
+    FILE *f;
+    int swapped, nsec;
+    uint32_t linktype;
+    uint8_t *pkt;
+    size_t size;
+    const char *errmsg;
+};
+
+static inline uint16_t rkpcap_get16(const uint8_t *p, int swap) {
+    return swap ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+}
+
+static inline uint32_t rkpcap_get32(const uint8_t *p, int swap) {
+    return swap ? (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]
+                : (uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static inline uint64_t rkpcap_get64(const uint8_t *p, int swap) {
+    return swap ? (uint64_t)rkpcap_get32(p, 1) << 32 | rkpcap_get32(p + 4, 1)
+                : (uint64_t)rkpcap_get32(p + 4, 0) << 32 | rkpcap_get32(p, 0);
+}
+
+static inline int rkpcap_reader_open(struct rkpcap_reader *r, const char *path) {
+    uint8_t fh[sizeof(struct rkpcap_file_header)];
+
+    memset(r, 0, sizeof(*r));
+    if (!(r->f = fopen(path, "rb"))) {
+        r->errmsg = strerror(errno);
+        return -1;
+    }
+    if (fread(fh, sizeof(fh), 1, r->f) != 1) {
+        r->errmsg = "too short for a pcap file";
+        goto fail;
+    }
+    switch (rkpcap_get32(fh, 0)) {
+    case RKPCAP_MAGIC:                                  break;
+    case RKPCAP_MAGIC_NSEC: r->nsec = 1;                break;
+    case 0xd4c3b2a1:        r->swapped = 1;             break;
+    case 0x4d3cb2a1:        r->swapped = r->nsec = 1;   break;
+    default:
+        r->errmsg = "not a pcap file";
+        goto fail;
+    }
+    r->linktype = rkpcap_get32(fh + 20, r->swapped) & 0x0fffffff;
+    if (r->linktype != RKPCAP_DLT_USBPCAP &&
+            r->linktype != RKPCAP_DLT_USB_LINUX &&
+            r->linktype != RKPCAP_DLT_USB_MMAPPED) {
+        r->errmsg = "not a USB capture";
+        goto fail;
+    }
+    return 0;
+
+fail:
+    fclose(r->f);
+    r->f = NULL;
+    return -1;
+}
+
+static inline void rkpcap_reader_close(struct rkpcap_reader *r) {
+    if (r->f) fclose(r->f);
+    free(r->pkt);
+    memset(r, 0, sizeof(*r));
+}
+
+/* 1 for a record, 0 at the end, -1 with errmsg set */
+static inline int rkpcap_next(struct rkpcap_reader *r, struct rkpcap_rec *rec) {
+    uint8_t rh[sizeof(struct rkpcap_rec_header)];
+    uint32_t incl_len, hlen;
+    const uint8_t *p;
+
+    for (;;) {
+        if (fread(rh, sizeof(rh), 1, r->f) != 1)
+            return 0;
+        incl_len = rkpcap_get32(rh + 8, r->swapped);
+        if (incl_len > r->size) {
+            uint8_t *n = realloc(r->pkt, incl_len);
+            if (!n) {
+                r->errmsg = strerror(ENOMEM);
+                return -1;
+            }
+            r->pkt = n;
+            r->size = incl_len;
+        }
+        if (fread(r->pkt, 1, incl_len, r->f) != incl_len) {
+            r->errmsg = "truncated record at the end";
+            return -1;
+        }
+
+        memset(rec, 0, sizeof(*rec));
+        rec->t = rkpcap_get32(rh, r->swapped) +
+                 rkpcap_get32(rh + 4, r->swapped) / (r->nsec ? 1e9 : 1e6);
+        p = r->pkt;
+
+        if (r->linktype == RKPCAP_DLT_USBPCAP) {
+            if (incl_len < RKPCAP_USBPCAP_LEN ||
+                    (hlen = rkpcap_get16(p, 0)) > incl_len)
+                continue;               /* not a USB packet */
+            rec->id       = rkpcap_get64(p + 2, 0);
+            rec->error    = rkpcap_get32(p + 10, 0) != 0;
+            rec->done     = p[16] & RKPCAP_INFO_PDO_TO_FDO;
+            rec->ep       = p[21];
+            rec->transfer = p[22];
+            rec->length   = rkpcap_get32(p + 23, 0);
+        } else {
+            hlen = r->linktype == RKPCAP_DLT_USB_MMAPPED ? 64 : 48;
+            if (incl_len < hlen)
+                continue;
+            rec->id       = rkpcap_get64(p, r->swapped);
+            rec->done     = p[8] != 'S';
+            rec->error    = p[8] == 'E' ||
+                            (rec->done && rkpcap_get32(p + 28, r->swapped));
+            rec->ep       = p[10];
+            rec->transfer = p[9];
+            rec->length   = rkpcap_get32(p + 32, r->swapped);
+        }
+        rec->data = p + hlen;
+        rec->len  = incl_len - hlen;
+        if (rec->len > rec->length)
+            rec->len = rec->length;
+        return 1;
+    }
+}
+
+/*
+ * Recording
+ *
+ * rkpcap_usb() builds the USBPcap record in a ring buffer and returns; a
+ * writer thread moves whole records from the ring to the file. There is
+ * one producer and one consumer, each owning one end of the ring, so no
+ * lock is taken on the way. When the writer falls behind, records are
+ * dropped and counted rather than making the caller wait.
+ */
+
+#define RKPCAP_RING             (16 << 20)  /* power of two */
+
+struct rkpcap_writer {
+    int fd;
+    uint8_t *ring;
+    atomic_size_t head, tail;           /* bytes ever put in, taken out */
+    atomic_int stop;
+    pthread_t thread;
+    uint16_t bus, device;
+    uint64_t records, drops;
+    int error;                          /* errno of a failed write */
+};
+
+static inline int rkpcap_write_all(int fd, const uint8_t *p, size_t len) {
+    ssize_t n;
+
+    while (len) {
+        if ((n = write(fd, p, len)) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *rkpcap_thread(void *arg) {
+    struct rkpcap_writer *w = arg;
+    size_t head, tail, pos, n;
+    int stop;
+
+    for (;;) {
+        stop = atomic_load_explicit(&w->stop, memory_order_acquire);
+        head = atomic_load_explicit(&w->head, memory_order_acquire);
+        tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+        if (head == tail) {
+            if (stop) break;
+            usleep(1000);
+            continue;
+        }
+        /* up to the end of the ring, the rest on the next turn */
+        pos = tail & (RKPCAP_RING - 1);
+        n = head - tail;
+        if (n > RKPCAP_RING - pos) n = RKPCAP_RING - pos;
+        if (!w->error && rkpcap_write_all(w->fd, w->ring + pos, n) < 0)
+            w->error = errno;
+        atomic_store_explicit(&w->tail, tail + n, memory_order_release);
+    }
+    return NULL;
+}
+
+static inline void rkpcap_put(struct rkpcap_writer *w, size_t *head,
+                              const void *p, size_t len) {
+    size_t pos = *head & (RKPCAP_RING - 1), n = RKPCAP_RING - pos;
+
+    if (n > len) n = len;
+    memcpy(w->ring + pos, p, n);
+    memcpy(w->ring, (const uint8_t *)p + n, len - n);
+    *head += len;
+}
+
+/*
+ * Records one end of a bulk transfer: done is 0 for the submission and 1
+ * for the completion, status a USBD_STATUS. data is what the record
+ * carries, if anything.
+ */
+static inline void rkpcap_usb(struct rkpcap_writer *w, uint64_t irp_id,
+                              uint8_t endpoint, int done, uint32_t status,
+                              const uint8_t *data, uint32_t len) {
+    struct rkpcap_rec_header rec;
+    struct rkpcap_usbpcap u;
+    struct timespec ts;
+    size_t head, tail;
+
+    if (!w->ring) return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (len > RKPCAP_SNAPLEN - RKPCAP_USBPCAP_LEN)
+        len = RKPCAP_SNAPLEN - RKPCAP_USBPCAP_LEN;
+
+    head = atomic_load_explicit(&w->head, memory_order_relaxed);
+    tail = atomic_load_explicit(&w->tail, memory_order_acquire);
+    if (head - tail + sizeof(rec) + RKPCAP_USBPCAP_LEN + len > RKPCAP_RING) {
+        w->drops++;
+        return;
+    }
+
+    rec.ts_sec   = ts.tv_sec;
+    rec.ts_frac  = ts.tv_nsec;
+    rec.incl_len = rec.orig_len = RKPCAP_USBPCAP_LEN + len;
+    u.header_len = RKPCAP_USBPCAP_LEN;
+    u.irp_id     = irp_id;
+    u.status     = status;
+    u.function   = RKPCAP_URB_BULK;
+    u.info       = done ? RKPCAP_INFO_PDO_TO_FDO : 0;
+    u.bus        = w->bus;
+    u.device     = w->device;
+    u.endpoint   = endpoint;
+    u.transfer   = RKPCAP_TRANSFER_BULK;
+    u.data_len   = len;
+
+    rkpcap_put(w, &head, &rec, sizeof(rec));
+    rkpcap_put(w, &head, &u, RKPCAP_USBPCAP_LEN);
+    if (len) rkpcap_put(w, &head, data, len);
+    atomic_store_explicit(&w->head, head, memory_order_release);
+    w->records++;
+}
+
+static inline int rkpcap_open(struct rkpcap_writer *w, const char *path,
+                              uint16_t bus, uint16_t device) {
+    struct rkpcap_file_header fh = {
+        RKPCAP_MAGIC_NSEC, 2, 4, 0, 0, RKPCAP_SNAPLEN, RKPCAP_DLT_USBPCAP
+    };
+
+    memset(w, 0, sizeof(*w));
+    w->bus = bus;
+    w->device = device;
+    if ((w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        return -1;
+    if (rkpcap_write_all(w->fd, (uint8_t *)&fh, sizeof(fh)) < 0 ||
+            !(w->ring = malloc(RKPCAP_RING))) {
+        close(w->fd);
+        return -1;
+    }
+    if ((errno = pthread_create(&w->thread, NULL, rkpcap_thread, w))) {
+        free(w->ring);
+        w->ring = NULL;
+        close(w->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Waits for the ring to be written out. Returns -1 with errno if it was not */
+static inline int rkpcap_close(struct rkpcap_writer *w) {
+    if (!w->ring) return 0;
+    atomic_store_explicit(&w->stop, 1, memory_order_release);
+    pthread_join(w->thread, NULL);
+    free(w->ring);
+    w->ring = NULL;
+    if (close(w->fd) < 0 && !w->error)
+        w->error = errno;
+    errno = w->error;
+    return w->error ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,64 @@
+/* rkraw.h - raw NAND dumps: pages with their spare area
+ *
+ * Copyright (C) 2010-2014 by Ivo van Poorten, Fukaumi Naoki, Guenter Knauf,
+ *                            Ulrich Prinz, Steve Wilson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _RKRAW_H_
+#define _RKRAW_H_
+
+#include <stdint.h>
+
+/*
+ * A raw dump is a header of RKRAW_HEADER_SIZE bytes, then the pages
+ * first_page up to first_page + npages - 1 in order, each as the loader
+ * sends it: page_sectors sectors of 512 data bytes, each followed by its
+ * RKRAW_SPARE bytes of spare area. All pages have the same size, so page p
+ * is at rkraw_offset(h, p) and a reader seeks to it without scanning. A
+ * dump that stopped early is shorter than its header says; the pages it
+ * has are still good. Numbers are little endian, the geometry is that of
+ * READFLASHINFO.
+ */
+
+#define RKRAW_MAGIC         "RKRAWNF1"
+#define RKRAW_HEADER_SIZE   512
+#define RKRAW_SPARE         16          /* bytes per sector */
+
+struct rkraw_header {
+    char magic[8];
+    uint32_t header_size;
+    uint32_t first_page, npages;
+    uint32_t page_bytes;                /* page_sectors * (512 + RKRAW_SPARE) */
+    uint16_t page_sectors;
+    uint16_t block_pages;
+    uint32_t flash_size;                /* sectors */
+    uint8_t ecc_bits, access_time, manufacturer_id, chip_select;
+    uint8_t flash_id[5];                /* READFLASHID */
+};
+
+static inline uint64_t rkraw_offset(const struct rkraw_header *h, uint32_t page) {
+    return h->header_size + (uint64_t)(page - h->first_page) * h->page_bytes;
+}
+
+#endif /* !_RKRAW_H_ */
@@ -0,0 +1,353 @@
+/* rkusb.h - USB helpers shared by rkflashtool and fxload
+ *
+ * Copyright (C) 2010-2014 by Ivo van Poorten, Fukaumi Naoki, Guenter Knauf,
+ *                            Ulrich Prinz, Steve Wilson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RKUSB_H_
+#define _RKUSB_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <libusb-1.0/libusb.h>
+
+#include "rkcrc.h"
+
+#define RKUSB_VENDOR        0x2207
+
+static const struct t_pid {
+    const uint16_t pid;
+    const char name[8];
+    const uint32_t sdram_base;      /* physical address of SDRAM offset 0 */
+} pidtab[] = {
+    { 0x281a, "RK2818",  0x60000000 },
+    { 0x290a, "RK2918",  0x60000000 },
+    { 0x292a, "RK2928",  0x60000000 },
+    { 0x292c, "RK3026",  0x60000000 },
+    { 0x300a, "RK3066",  0x60000000 },
+    { 0x300b, "RK3168",  0x60000000 },
+    { 0x310a, "RK3066B", 0x60000000 },
+    { 0x310b, "RK3188",  0x60000000 },
+    { 0x320a, "RK3288",  0x00000000 },
+    { 0, "", 0 },
+};
+
+static inline const struct t_pid *rkusb_find_pid(uint16_t vid, uint16_t pid) {
+    const struct t_pid *ppid;
+
+    if (vid != RKUSB_VENDOR) return NULL;
+    for (ppid = pidtab; ppid->pid; ppid++)
+        if (ppid->pid == pid) return ppid;
+    return NULL;
+}
+
+/* Physical location of a device, "bus-port.port..." as in sysfs */
+static inline void rkusb_port_name(libusb_device *dev, char *s, size_t n) {
+    uint8_t ports[8];
+    int i, np = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    size_t l;
+
+    snprintf(s, n, "%d", libusb_get_bus_number(dev));
+    for (i = 0; i < np; i++) {
+        l = strlen(s);
+        snprintf(s + l, n - l, "%c%d", i ? '.' : '-', ports[i]);
+    }
+}
+
+struct rkusb_dev {
+    libusb_device *dev;
+    const struct t_pid *pid;
+    char port[32];
+    int maskrom;
+};
+
+/* All attached Rockchip devices in a single pass over the bus, instead of
+ * one libusb_open_device_with_vid_pid() (a full enumeration each) per
+ * pidtab entry. Returns the number of devices or a libusb error.
+ */
+static inline int rkusb_scan(libusb_context *c, struct rkusb_dev **list) {
+    struct libusb_device_descriptor desc;
+    libusb_device **devs;
+    ssize_t n, i;
+    int count = 0;
+
+    if ((n = libusb_get_device_list(c, &devs)) < 0) return n;
+    if (!(*list = calloc(n + 1, sizeof(**list)))) {
+        libusb_free_device_list(devs, 1);
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct rkusb_dev *d = *list + count;
+
+        if (libusb_get_device_descriptor(devs[i], &desc) ||
+                !(d->pid = rkusb_find_pid(desc.idVendor, desc.idProduct)))
+            continue;
+        d->dev     = libusb_ref_device(devs[i]);
+        d->maskrom = desc.bcdUSB == 0x200;
+        rkusb_port_name(devs[i], d->port, sizeof(d->port));
+        count++;
+    }
+
+    libusb_free_device_list(devs, 1);
+    return count;
+}
+
+static inline void rkusb_free_scan(struct rkusb_dev *list, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) libusb_unref_device(list[i].dev);
+    free(list);
+}
+
+static inline double rk_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * MASK ROM upload
+ *
+ * The mask ROM takes the DDR init (wIndex 0x471) and the usbplug loader
+ * (wIndex 0x472) as a series of 4 KiB vendor control transfers.  The last
+ * transfer carries the remainder of the image followed by the big endian
+ * CRC16 of the whole image (if the image is a multiple of 4 KiB, the CRC
+ * goes out on its own).
+ *
+ * rkimage_load() reads the whole image up front and lays it out as ready
+ * to submit control transfers (setup packet + payload), CRC included, so
+ * no file I/O or checksumming happens while the device is waiting.  The
+ * uploader keeps RKLOAD_DEPTH transfers queued on ep0 at all times.  An
+ * image is read-only once loaded and can be uploaded to several devices
+ * at the same time.
+ */
+
+#define RKLOAD_DDR          0x0471
+#define RKLOAD_USBPLUG      0x0472
+#define RKLOAD_CHUNK        4096
+#define RKLOAD_SLOT         (LIBUSB_CONTROL_SETUP_SIZE + RKLOAD_CHUNK + 2)
+#define RKLOAD_DEPTH        2
+#define RKLOAD_TIMEOUT      (10*1000)
+
+struct rkimage {
+    uint8_t *slots;         /* nslots * RKLOAD_SLOT bytes */
+    int nslots;
+    size_t size;            /* image size, without CRC */
+    uint16_t index, crc16;
+    double t_load;          /* seconds spent reading and signing */
+};
+
+struct rkupload {
+    const struct rkimage *img;
+    struct libusb_transfer *xfr[RKLOAD_DEPTH];
+    int next, done, inflight, status;
+    double t_start, t_end;
+    void (*cb)(struct rkupload *);
+    void *user;
+};
+
+static inline int rkimage_len(const struct rkimage *img, int slot) {
+    if (slot < img->nslots - 1) return RKLOAD_CHUNK;
+    return img->size - (size_t)slot * RKLOAD_CHUNK + 2;
+}
+
+static inline void rkimage_free(struct rkimage *img) {
+    free(img->slots);
+    img->slots = NULL;
+    img->nslots = 0;
+}
+
+static inline int rkimage_load(struct rkimage *img, int fd, uint16_t index) {
+    uint8_t *data = NULL, *p;
+    size_t size = 0, alloc = 0;
+    ssize_t nr;
+    int i;
+    double t = rk_now();
+
+    for (;;) {
+        if (size == alloc) {
+            alloc = alloc ? alloc * 2 : 256*1024;
+            if (!(p = realloc(data, alloc))) goto err;
+            data = p;
+        }
+        nr = read(fd, data + size, alloc - size);
+        if (nr < 0) {
+            if (errno == EINTR) continue;
+            goto err;
+        }
+        if (!nr) break;
+        size += nr;
+    }
+
+    img->size   = size;
+    img->index  = index;
+    img->crc16  = rkcrc16(0xffff, data, size);
+    img->nslots = size / RKLOAD_CHUNK + 1;
+    if (!(img->slots = malloc((size_t)img->nslots * RKLOAD_SLOT))) goto err;
+
+    for (i = 0; i < img->nslots; i++) {
+        uint8_t *s = img->slots + (size_t)i * RKLOAD_SLOT;
+        int len = rkimage_len(img, i);
+        int n = i < img->nslots - 1 ? len : len - 2;
+
+        libusb_fill_control_setup(s, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR,
+                                  12, 0, index, len);
+        memcpy(s + LIBUSB_CONTROL_SETUP_SIZE, data + (size_t)i * RKLOAD_CHUNK, n);
+        if (n != len) {
+            s[LIBUSB_CONTROL_SETUP_SIZE + n]     = img->crc16 >> 8;
+            s[LIBUSB_CONTROL_SETUP_SIZE + n + 1] = img->crc16 & 0xff;
+        }
+    }
+    free(data);
+
+    img->t_load = rk_now() - t;
+    return 0;
+
+err:
+    free(data);
+    img->slots = NULL;
+    return -1;
+}
+
+static inline int rkusb_xfr_error(enum libusb_transfer_status s) {
+    switch (s) {
+    case LIBUSB_TRANSFER_COMPLETED: return LIBUSB_SUCCESS;
+    case LIBUSB_TRANSFER_TIMED_OUT: return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_STALL:     return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE: return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:  return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_CANCELLED: return LIBUSB_ERROR_INTERRUPTED;
+    default:                        return LIBUSB_ERROR_IO;
+    }
+}
+
+static inline void rkupload_finish(struct rkupload *u) {
+    int i;
+
+    u->t_end = rk_now();
+    for (i = 0; i < RKLOAD_DEPTH; i++) {
+        libusb_free_transfer(u->xfr[i]);
+        u->xfr[i] = NULL;
+    }
+    if (u->cb) u->cb(u);
+}
+
+static inline int rkupload_submit(struct rkupload *u, struct libusb_transfer *xfr) {
+    uint8_t *s = u->img->slots + (size_t)u->next * RKLOAD_SLOT;
+    int r;
+
+    xfr->buffer = s;
+    xfr->length = LIBUSB_CONTROL_SETUP_SIZE + rkimage_len(u->img, u->next);
+    if ((r = libusb_submit_transfer(xfr)) < 0) return r;
+    u->next++;
+    u->inflight++;
+    return 0;
+}
+
+static inline void LIBUSB_CALL rkupload_cb(struct libusb_transfer *xfr) {
+    struct rkupload *u = xfr->user_data;
+    int r;
+
+    u->inflight--;
+
+    if (xfr->status != LIBUSB_TRANSFER_COMPLETED && !u->status)
+        u->status = rkusb_xfr_error(xfr->status);
+
+    if (!u->status) {
+        u->done++;
+        if (u->next < u->img->nslots && (r = rkupload_submit(u, xfr)) < 0)
+            u->status = r;
+    }
+
+    if (!u->inflight) rkupload_finish(u);
+}
+
+/* Start an asynchronous upload, u->cb is called from the event loop once
+ * it is done or has failed (u->status is a libusb error code then).
+ */
+static inline int rkupload_start(struct rkupload *u, libusb_device_handle *h,
+                          const struct rkimage *img,
+                          void (*cb)(struct rkupload *), void *user) {
+    int i, r = 0;
+
+    memset(u, 0, sizeof(*u));
+    u->img  = img;
+    u->cb   = cb;
+    u->user = user;
+
+    for (i = 0; i < RKLOAD_DEPTH; i++) {
+        if (!(u->xfr[i] = libusb_alloc_transfer(0))) {
+            r = LIBUSB_ERROR_NO_MEM;
+            goto err;
+        }
+        libusb_fill_control_transfer(u->xfr[i], h, img->slots, rkupload_cb,
+                                     u, RKLOAD_TIMEOUT);
+    }
+
+    u->t_start = rk_now();
+    for (i = 0; i < RKLOAD_DEPTH && u->next < img->nslots; i++)
+        if ((r = rkupload_submit(u, u->xfr[i])) < 0) {
+            u->status = r;
+            if (!u->inflight) goto err;
+            return 0;               /* in flight ones finish the upload */
+        }
+    return 0;
+
+err:
+    for (i = 0; i < RKLOAD_DEPTH; i++) {
+        libusb_free_transfer(u->xfr[i]);
+        u->xfr[i] = NULL;
+    }
+    return r;
+}
+
+static inline void rkupload_done(struct rkupload *u) {
+    *(int *)u->user = 1;
+}
+
+/* Synchronous upload, drives the libusb event loop until done */
+static inline int rkupload_run(libusb_context *c, libusb_device_handle *h,
+                        const struct rkimage *img, struct rkupload *u) {
+    int completed = 0, r;
+
+    if ((r = rkupload_start(u, h, img, rkupload_done, &completed)) < 0)
+        return u->status = r;
+    while (!completed)
+        if ((r = libusb_handle_events_completed(c, &completed)) < 0
+                && r != LIBUSB_ERROR_INTERRUPTED)
+            return u->status = r;
+    return u->status;
+}
+
+static inline double rkupload_rate(const struct rkupload *u) {
+    double t = u->t_end - u->t_start;
+    return t > 0 ? (u->img->size + 2) / t / 1024 : 0;
+}
+
+#endif /* !_RKUSB_H_ */
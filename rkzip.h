@@ -0,0 +1,935 @@
+/* rkzip.h - threaded compression of rkflashtool dumps
+ *
+ * Copyright (C) 2010-2014 by Ivo van Poorten, Fukaumi Naoki, Guenter Knauf,
+ *                            Ulrich Prinz, Steve Wilson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RKZIP_H_
+#define _RKZIP_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+/*
+ * Writing
+ *
+ * Output is cut into blocks of RKZIP_BLOCK bytes which are compressed by a
+ * pool of worker threads into independent gzip members or zstd frames and
+ * written in order. Any gzip or zstd decompressor reads the result as one
+ * stream, and rkflashtool can decompress the blocks in parallel again.
+ *
+ * A gzip member carries its own compressed size in an 'RK' extra field,
+ * like the 'BC' field of BGZF but 32 bits wide.
+ */
+
+#define RKZIP_BLOCK         (1 << 20)
+#define RKZIP_MAX_JOB       (64 << 20)  /* larger members are streamed */
+#define RKZIP_GZ_HEADER     20
+#define RKZIP_GZ_TRAILER    8
+
+enum { RKZIP_NONE, RKZIP_GZIP, RKZIP_ZSTD, RKZIP_XZ };
+enum { RKZIP_FREE, RKZIP_FILLING, RKZIP_QUEUED, RKZIP_BUSY, RKZIP_READY };
+
+static const char *const rkzip_names[] = { "plain", "gzip", "zstd", "xz" };
+
+struct rkzip_block {
+    uint8_t *in, *out;
+    size_t in_len, in_size, out_len, out_size;
+    uint64_t seq;
+    int state;
+};
+
+static inline int rkzip_reserve(uint8_t **p, size_t *size, size_t need) {
+    if (need <= *size) return 0;
+    free(*p);
+    if (!(*p = malloc(need))) {
+        *size = 0;
+        return -1;
+    }
+    *size = need;
+    return 0;
+}
+
+struct rkzip_writer {
+    int fd, method, level, nblocks, nthreads;
+    pthread_t *threads;
+    struct rkzip_block *blocks, *cur;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t seq_in, seq_out;   /* next block to fill, next to write */
+    uint64_t bytes_in, bytes_out;
+    int error, quit;
+};
+
+/* "gzip", "gzip:9", "zstd:19"; returns -1 if unknown or not built in */
+static inline int rkzip_method(const char *s, int *level) {
+    const char *colon = strchr(s, ':');
+    size_t n = colon ? (size_t)(colon - s) : strlen(s);
+    int method;
+
+    if ((n == 4 && !strncmp(s, "gzip", 4)) || (n == 2 && !strncmp(s, "gz", 2)))
+        method = RKZIP_GZIP;
+#ifdef HAVE_ZSTD
+    else if ((n == 4 && !strncmp(s, "zstd", 4)) || (n == 3 && !strncmp(s, "zst", 3)))
+        method = RKZIP_ZSTD;
+#endif
+    else
+        return -1;
+
+    *level = colon ? atoi(colon + 1) : method == RKZIP_GZIP ? 6 : 3;
+    return method;
+}
+
+static inline int rkzip_gzip(struct rkzip_block *b, int level) {
+    z_stream zs;
+    size_t need;
+    uint32_t crc;
+    uint8_t *p;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    need = RKZIP_GZ_HEADER + deflateBound(&zs, b->in_len) + RKZIP_GZ_TRAILER;
+    if (rkzip_reserve(&b->out, &b->out_size, need)) {
+        deflateEnd(&zs);
+        return -1;
+    }
+
+    zs.next_in   = b->in;
+    zs.avail_in  = b->in_len;
+    zs.next_out  = b->out + RKZIP_GZ_HEADER;
+    zs.avail_out = b->out_size - RKZIP_GZ_HEADER - RKZIP_GZ_TRAILER;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    b->out_len = RKZIP_GZ_HEADER + zs.total_out + RKZIP_GZ_TRAILER;
+    deflateEnd(&zs);
+
+    /* ID1 ID2 CM FLG(FEXTRA) MTIME XFL OS XLEN, SI1 SI2 LEN, member size */
+    p = b->out;
+    memcpy(p, "\x1f\x8b\x08\x04\0\0\0\0\0\xff\x08\0RK\x04\0", 16);
+    p[16] = b->out_len;         p[17] = b->out_len >> 8;
+    p[18] = b->out_len >> 16;   p[19] = b->out_len >> 24;
+
+    crc = crc32(0, b->in, b->in_len);
+    p = b->out + b->out_len - RKZIP_GZ_TRAILER;
+    p[0] = crc;         p[1] = crc >> 8;
+    p[2] = crc >> 16;   p[3] = crc >> 24;
+    p[4] = b->in_len;         p[5] = b->in_len >> 8;
+    p[6] = b->in_len >> 16;   p[7] = b->in_len >> 24;
+    return 0;
+}
+
+#ifdef HAVE_ZSTD
+static inline int rkzip_zstd(struct rkzip_block *b, int level) {
+    size_t r;
+
+    if (rkzip_reserve(&b->out, &b->out_size, ZSTD_compressBound(b->in_len)))
+        return -1;
+    r = ZSTD_compress(b->out, b->out_size, b->in, b->in_len, level);
+    if (ZSTD_isError(r)) return -1;
+    b->out_len = r;
+    return 0;
+}
+#endif
+
+static inline int rkzip_write_all(int fd, const uint8_t *p, size_t len) {
+    ssize_t n;
+
+    while (len) {
+        if ((n = write(fd, p, len)) <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void *rkzip_worker(void *arg) {
+    struct rkzip_writer *z = arg;
+    struct rkzip_block *b;
+    int i, r;
+
+    pthread_mutex_lock(&z->lock);
+    for (;;) {
+        /* oldest queued block first, so the writer never waits for long */
+        for (b = NULL, i = 0; i < z->nblocks; i++)
+            if (z->blocks[i].state == RKZIP_QUEUED &&
+                    (!b || z->blocks[i].seq < b->seq))
+                b = &z->blocks[i];
+        if (!b) {
+            if (z->quit) break;
+            pthread_cond_wait(&z->cond, &z->lock);
+            continue;
+        }
+        b->state = RKZIP_BUSY;
+        pthread_mutex_unlock(&z->lock);
+        errno = 0;
+
+#ifdef HAVE_ZSTD
+        if (z->method == RKZIP_ZSTD)
+            r = rkzip_zstd(b, z->level);
+        else
+#endif
+            r = rkzip_gzip(b, z->level);
+
+        pthread_mutex_lock(&z->lock);
+        while (z->seq_out != b->seq)
+            pthread_cond_wait(&z->cond, &z->lock);
+        pthread_mutex_unlock(&z->lock);
+
+        if (!r && !z->error)
+            r = rkzip_write_all(z->fd, b->out, b->out_len);
+
+        pthread_mutex_lock(&z->lock);
+        if (r) z->error = errno ? errno : EIO;
+        else z->bytes_out += b->out_len;
+        z->seq_out++;
+        b->state = RKZIP_FREE;
+        pthread_cond_broadcast(&z->cond);
+    }
+    pthread_mutex_unlock(&z->lock);
+    return NULL;
+}
+
+static inline void rkzip_free(struct rkzip_writer *z) {
+    int i;
+
+    if (z->blocks)
+        for (i = 0; i < z->nblocks; i++) {
+            free(z->blocks[i].in);
+            free(z->blocks[i].out);
+        }
+    free(z->blocks);
+    free(z->threads);
+    z->blocks = NULL;
+    z->threads = NULL;
+}
+
+/* nthreads <= 0 uses one thread per CPU */
+static inline int rkzip_open(struct rkzip_writer *z, int fd, int method,
+                             int level, int nthreads) {
+    int i;
+
+    memset(z, 0, sizeof(*z));
+    if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) nthreads = 1;
+    z->fd = fd;
+    z->method = method;
+    z->level = level;
+    z->nblocks = 2 * nthreads;
+
+    z->blocks = calloc(z->nblocks, sizeof(*z->blocks));
+    z->threads = calloc(nthreads, sizeof(*z->threads));
+    if (!z->blocks || !z->threads) goto fail;
+    for (i = 0; i < z->nblocks; i++)
+        if (rkzip_reserve(&z->blocks[i].in, &z->blocks[i].in_size, RKZIP_BLOCK))
+            goto fail;
+
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->cond, NULL);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&z->threads[i], NULL, rkzip_worker, z)) break;
+        z->nthreads++;
+    }
+    if (z->nthreads) return 0;
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->cond);
+fail:
+    rkzip_free(z);
+    errno = ENOMEM;
+    return -1;
+}
+
+/* Hand the block being filled to the workers */
+static inline void rkzip_queue(struct rkzip_writer *z) {
+    pthread_mutex_lock(&z->lock);
+    z->cur->state = RKZIP_QUEUED;
+    z->cur = NULL;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+}
+
+static inline int rkzip_write(struct rkzip_writer *z, const void *data,
+                              size_t len) {
+    const uint8_t *p = data;
+    size_t n;
+    int i;
+
+    while (len) {
+        if (!z->cur) {
+            pthread_mutex_lock(&z->lock);
+            for (;;) {
+                for (i = 0; i < z->nblocks; i++)
+                    if (z->blocks[i].state == RKZIP_FREE) break;
+                if (i < z->nblocks || z->error) break;
+                pthread_cond_wait(&z->cond, &z->lock);
+            }
+            if (z->error) {
+                errno = z->error;
+                pthread_mutex_unlock(&z->lock);
+                return -1;
+            }
+            z->cur = &z->blocks[i];
+            z->cur->state = RKZIP_FILLING;
+            z->cur->seq = z->seq_in++;
+            z->cur->in_len = 0;
+            pthread_mutex_unlock(&z->lock);
+        }
+
+        n = RKZIP_BLOCK - z->cur->in_len;
+        if (n > len) n = len;
+        memcpy(z->cur->in + z->cur->in_len, p, n);
+        z->cur->in_len += n;
+        z->bytes_in += n;
+        p += n;
+        len -= n;
+
+        if (z->cur->in_len == RKZIP_BLOCK)
+            rkzip_queue(z);
+    }
+    return 0;
+}
+
+/* Flush, wait for the workers and free everything; 0 or -1 with errno */
+static inline int rkzip_close(struct rkzip_writer *z) {
+    int i, error;
+
+    /* an empty stream still gets one (empty) member */
+    if (!z->cur && !z->seq_in) {
+        z->cur = &z->blocks[0];
+        z->cur->seq = z->seq_in++;
+        z->cur->in_len = 0;
+    }
+    if (z->cur)
+        rkzip_queue(z);
+
+    pthread_mutex_lock(&z->lock);
+    z->quit = 1;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    for (i = 0; i < z->nthreads; i++)
+        pthread_join(z->threads[i], NULL);
+
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->cond);
+    rkzip_free(z);
+    error = z->error;
+    if (error) errno = error;
+    return error ? -1 : 0;
+}
+
+/*
+ * Reading
+ *
+ * The input is recognized by its magic and decompressed ahead of the
+ * consumer. A reader thread cuts gzip members written by rkzip (which
+ * carry their size) and zstd frames with a known size into jobs, which
+ * the worker threads decompress in parallel. Other gzip and zstd streams
+ * are decompressed by the reader thread itself, xz with liblzma's own
+ * threads. Plain input is passed through, still read ahead.
+ */
+
+struct rkzip_reader {
+    int fd, method, njobs, nthreads;
+    int xz_threads;             /* for liblzma, not in threads */
+    pthread_t reader, *threads;
+    struct rkzip_block *jobs, *cur;
+    size_t cur_pos;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t seq_in, seq_out;   /* next job to hand out, next to consume */
+    uint64_t bytes_in, bytes_out;
+    int eof, quit, error;
+    const char *errmsg;
+    /* compressed input, owned by the reader thread once it runs */
+    uint8_t *ibuf;
+    size_t ipos, ilen, isize;
+};
+
+/* Makes at least need bytes available; returns how many are, less at EOF */
+static inline ssize_t rkzip_fill(struct rkzip_reader *r, size_t need) {
+    ssize_t n;
+    int state;
+
+    while (r->ilen - r->ipos < need) {
+        if (r->ipos) {
+            memmove(r->ibuf, r->ibuf + r->ipos, r->ilen - r->ipos);
+            r->ilen -= r->ipos;
+            r->ipos = 0;
+        }
+        if (r->isize < need + 65536) {
+            uint8_t *p = realloc(r->ibuf, need + 65536);
+            if (!p) return -1;
+            r->ibuf = p;
+            r->isize = need + 65536;
+        }
+        /* the consumer may stop early, with us blocked on a pipe */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+        n = read(r->fd, r->ibuf + r->ilen, r->isize - r->ilen);
+        pthread_setcancelstate(state, NULL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        r->ilen += n;
+        r->bytes_in += n;
+    }
+    return r->ilen - r->ipos;
+}
+
+/* Next free job in stream order, or NULL when the consumer went away */
+static inline struct rkzip_block *rkzip_get_job(struct rkzip_reader *r) {
+    struct rkzip_block *j = NULL;
+    int i;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->quit) {
+        for (i = 0; i < r->njobs; i++)
+            if (r->jobs[i].state == RKZIP_FREE) break;
+        if (i < r->njobs) {
+            j = &r->jobs[i];
+            j->state = RKZIP_FILLING;
+            j->seq = r->seq_in++;
+            j->in_len = j->out_len = 0;
+            break;
+        }
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return j;
+}
+
+static inline void rkzip_put_job(struct rkzip_reader *r,
+                                 struct rkzip_block *j, int state) {
+    pthread_mutex_lock(&r->lock);
+    j->state = state;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/*
+ * Streaming decoders: a step moves data from in to out and returns 0 to go
+ * on, 1 at the end of the stream or -1 on corrupt or truncated input. eof
+ * is set once no more input will come.
+ */
+
+typedef int (*rkzip_step)(void *st, const uint8_t **in, size_t *avail,
+                          uint8_t **out, size_t *room, int eof);
+
+static int rkzip_step_raw(void *st, const uint8_t **in, size_t *avail,
+                          uint8_t **out, size_t *room, int eof) {
+    size_t n = *avail < *room ? *avail : *room;
+
+    memcpy(*out, *in, n);
+    *in += n;   *avail -= n;
+    *out += n;  *room -= n;
+    return eof;
+}
+
+struct rkzip_gz_state {
+    z_stream zs;
+    int member_end;
+};
+
+static int rkzip_step_gzip(void *st, const uint8_t **in, size_t *avail,
+                           uint8_t **out, size_t *room, int eof) {
+    struct rkzip_gz_state *g = st;
+    int ret;
+
+    if (g->member_end) {
+        /* members are concatenated, anything else at the end is ignored */
+        if (!*avail || **in != 0x1f) return eof || *avail ? 1 : 0;
+        inflateReset(&g->zs);
+        g->member_end = 0;
+    }
+
+    g->zs.next_in   = (uint8_t *)*in;
+    g->zs.avail_in  = *avail;
+    g->zs.next_out  = *out;
+    g->zs.avail_out = *room;
+    ret = inflate(&g->zs, Z_NO_FLUSH);
+    *in  += *avail - g->zs.avail_in;
+    *out += *room - g->zs.avail_out;
+    *avail = g->zs.avail_in;
+    *room  = g->zs.avail_out;
+
+    if (ret == Z_STREAM_END) {
+        g->member_end = 1;
+        return 0;
+    }
+    if (ret == Z_BUF_ERROR) return eof ? -1 : 0;
+    return ret == Z_OK ? 0 : -1;
+}
+
+#ifdef HAVE_ZSTD
+struct rkzip_zstd_state {
+    ZSTD_DStream *ds;
+    size_t last;
+};
+
+static int rkzip_step_zstd(void *st, const uint8_t **in, size_t *avail,
+                           uint8_t **out, size_t *room, int eof) {
+    struct rkzip_zstd_state *zs = st;
+    ZSTD_inBuffer ib = { *in, *avail, 0 };
+    ZSTD_outBuffer ob = { *out, *room, 0 };
+    size_t ret = ZSTD_decompressStream(zs->ds, &ob, &ib);
+
+    if (ZSTD_isError(ret)) return -1;
+    *in += ib.pos;   *avail -= ib.pos;
+    *out += ob.pos;  *room -= ob.pos;
+    /* 0 means a frame just ended and nothing is left to flush */
+    if (eof && !ib.pos && !ob.pos) return zs->last == 0 ? 1 : -1;
+    zs->last = ret;
+    return 0;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static int rkzip_step_xz(void *st, const uint8_t **in, size_t *avail,
+                         uint8_t **out, size_t *room, int eof) {
+    lzma_stream *ls = st;
+    lzma_ret ret;
+
+    ls->next_in   = *in;
+    ls->avail_in  = *avail;
+    ls->next_out  = *out;
+    ls->avail_out = *room;
+    ret = lzma_code(ls, eof ? LZMA_FINISH : LZMA_RUN);
+    *in  += *avail - ls->avail_in;
+    *out += *room - ls->avail_out;
+    *avail = ls->avail_in;
+    *room  = ls->avail_out;
+
+    if (ret == LZMA_STREAM_END) return 1;
+    return ret == LZMA_OK ? 0 : -1;
+}
+#endif
+
+/* Runs a streaming decoder from the reader thread until the end */
+static int rkzip_stream(struct rkzip_reader *r, rkzip_step step, void *st) {
+    struct rkzip_block *j;
+    const uint8_t *in;
+    uint8_t *out;
+    size_t avail, room;
+    ssize_t n;
+    int ret = 0;
+
+    while (!ret && (j = rkzip_get_job(r))) {
+        if (rkzip_reserve(&j->out, &j->out_size, RKZIP_BLOCK)) return -1;
+        while (!ret && j->out_len < RKZIP_BLOCK) {
+            if ((n = rkzip_fill(r, 1)) < 0) return -1;
+            in = r->ibuf + r->ipos;
+            avail = n;
+            out = j->out + j->out_len;
+            room = RKZIP_BLOCK - j->out_len;
+            ret = step(st, &in, &avail, &out, &room, n == 0);
+            r->ipos = in - r->ibuf;
+            j->out_len = out - j->out;
+        }
+        rkzip_put_job(r, j, RKZIP_READY);
+    }
+    if (ret < 0) r->errmsg = "corrupt or truncated input";
+    return ret < 0 ? -1 : 0;
+}
+
+static int rkzip_stream_gzip(struct rkzip_reader *r) {
+    struct rkzip_gz_state g;
+    int ret;
+
+    memset(&g, 0, sizeof(g));
+    if (inflateInit2(&g.zs, 15 + 16) != Z_OK) return -1;
+    ret = rkzip_stream(r, rkzip_step_gzip, &g);
+    inflateEnd(&g.zs);
+    return ret;
+}
+
+/* gzip: members with an 'RK' size field go to the workers */
+static int rkzip_split_gzip(struct rkzip_reader *r) {
+    struct rkzip_block *j;
+    const uint8_t *p;
+    uint32_t size, isize;
+    ssize_t n;
+
+    for (;;) {
+        if ((n = rkzip_fill(r, RKZIP_GZ_HEADER)) <= 0) return n;
+        p = r->ibuf + r->ipos;
+        if (n < RKZIP_GZ_HEADER ||
+                memcmp(p, "\x1f\x8b\x08\x04", 4) ||
+                memcmp(p + 10, "\x08\0RK\x04\0", 6))
+            return rkzip_stream_gzip(r);
+
+        size = p[16] | p[17] << 8 | p[18] << 16 | (uint32_t)p[19] << 24;
+        if (size < RKZIP_GZ_HEADER + RKZIP_GZ_TRAILER || size > RKZIP_MAX_JOB)
+            return rkzip_stream_gzip(r);
+        if ((n = rkzip_fill(r, size)) < 0) return -1;
+        if (n < size) {
+            r->errmsg = "truncated input";
+            return -1;
+        }
+        p = r->ibuf + r->ipos + size - 4;
+        isize = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        if (isize > RKZIP_MAX_JOB) return rkzip_stream_gzip(r);
+
+        if (!(j = rkzip_get_job(r))) return 0;
+        if (rkzip_reserve(&j->in, &j->in_size, size)) return -1;
+        memcpy(j->in, r->ibuf + r->ipos, size);
+        j->in_len = size;
+        j->out_len = isize;
+        r->ipos += size;
+        rkzip_put_job(r, j, RKZIP_QUEUED);
+    }
+}
+
+#ifdef HAVE_ZSTD
+static int rkzip_stream_zstd(struct rkzip_reader *r) {
+    struct rkzip_zstd_state zs;
+    int ret;
+
+    if (!(zs.ds = ZSTD_createDStream())) return -1;
+    ZSTD_initDStream(zs.ds);
+    zs.last = 0;
+    ret = rkzip_stream(r, rkzip_step_zstd, &zs);
+    ZSTD_freeDStream(zs.ds);
+    return ret;
+}
+
+/* zstd: frames whose size is known up front go to the workers */
+static int rkzip_split_zstd(struct rkzip_reader *r) {
+    struct rkzip_block *j;
+    unsigned long long csize;
+    size_t fsize;
+    ssize_t n, want;
+
+    for (;;) {
+        if ((n = rkzip_fill(r, 18)) <= 0) return n;
+        csize = ZSTD_getFrameContentSize(r->ibuf + r->ipos, n);
+        if (csize == ZSTD_CONTENTSIZE_UNKNOWN ||
+                csize == ZSTD_CONTENTSIZE_ERROR || csize > RKZIP_MAX_JOB)
+            return rkzip_stream_zstd(r);
+
+        /* read until the whole frame is there */
+        for (want = 65536; ; want *= 2) {
+            if ((n = rkzip_fill(r, want)) < 0) return -1;
+            fsize = ZSTD_findFrameCompressedSize(r->ibuf + r->ipos, n);
+            if (!ZSTD_isError(fsize)) break;
+            if (n < want || want >= RKZIP_MAX_JOB)
+                return rkzip_stream_zstd(r);
+        }
+
+        if (!(j = rkzip_get_job(r))) return 0;
+        if (rkzip_reserve(&j->in, &j->in_size, fsize)) return -1;
+        memcpy(j->in, r->ibuf + r->ipos, fsize);
+        j->in_len = fsize;
+        j->out_len = csize;
+        r->ipos += fsize;
+        rkzip_put_job(r, j, RKZIP_QUEUED);
+    }
+}
+#endif
+
+#ifdef HAVE_LZMA
+static int rkzip_stream_xz(struct rkzip_reader *r) {
+    lzma_stream ls = LZMA_STREAM_INIT;
+    int ret;
+#if LZMA_VERSION >= 50040002
+    lzma_mt mt;
+
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = r->xz_threads;
+    mt.memlimit_threading = UINT64_MAX;
+    mt.memlimit_stop = UINT64_MAX;
+    if (lzma_stream_decoder_mt(&ls, &mt) != LZMA_OK) return -1;
+#else
+    if (lzma_stream_decoder(&ls, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+        return -1;
+#endif
+    ret = rkzip_stream(r, rkzip_step_xz, &ls);
+    lzma_end(&ls);
+    return ret;
+}
+#endif
+
+static void *rkzip_reader_main(void *arg) {
+    struct rkzip_reader *r = arg;
+    int ret;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    switch (r->method) {
+    case RKZIP_GZIP:
+        ret = rkzip_split_gzip(r);
+        break;
+#ifdef HAVE_ZSTD
+    case RKZIP_ZSTD:
+        ret = rkzip_split_zstd(r);
+        break;
+#endif
+#ifdef HAVE_LZMA
+    case RKZIP_XZ:
+        ret = rkzip_stream_xz(r);
+        break;
+#endif
+    default:
+        ret = rkzip_stream(r, rkzip_step_raw, NULL);
+        break;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    if (ret < 0 && !r->error) {
+        r->error = errno ? errno : EIO;
+        if (!r->errmsg) r->errmsg = strerror(r->error);
+    }
+    r->eof = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static void *rkzip_unzip_worker(void *arg) {
+    struct rkzip_reader *r = arg;
+    struct rkzip_block *j;
+    z_stream zs;
+    int i, ok;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        for (j = NULL, i = 0; i < r->njobs; i++)
+            if (r->jobs[i].state == RKZIP_QUEUED &&
+                    (!j || r->jobs[i].seq < j->seq))
+                j = &r->jobs[i];
+        if (!j) {
+            if (r->quit || r->eof) break;
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+        j->state = RKZIP_BUSY;
+        pthread_mutex_unlock(&r->lock);
+
+        /* out_len is the size the member or frame says it holds */
+        ok = !rkzip_reserve(&j->out, &j->out_size, j->out_len ? j->out_len : 1);
+#ifdef HAVE_ZSTD
+        if (ok && r->method == RKZIP_ZSTD) {
+            ok = ZSTD_decompress(j->out, j->out_len, j->in, j->in_len) == j->out_len;
+        } else
+#endif
+        if (ok) {
+            memset(&zs, 0, sizeof(zs));
+            ok = inflateInit2(&zs, 15 + 16) == Z_OK;
+            if (ok) {
+                zs.next_in   = j->in;
+                zs.avail_in  = j->in_len;
+                zs.next_out  = j->out;
+                zs.avail_out = j->out_len;
+                ok = inflate(&zs, Z_FINISH) == Z_STREAM_END &&
+                     zs.total_out == j->out_len;
+                inflateEnd(&zs);
+            }
+        }
+
+        pthread_mutex_lock(&r->lock);
+        if (!ok && !r->error) {
+            r->error = EIO;
+            r->errmsg = "corrupt input";
+        }
+        j->state = RKZIP_READY;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/* Stops the threads and frees everything */
+static inline void rkzip_reader_close(struct rkzip_reader *r) {
+    int i;
+
+    if (!r->jobs) return;
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_cancel(r->reader);
+    pthread_join(r->reader, NULL);
+    for (i = 0; i < r->nthreads; i++)
+        pthread_join(r->threads[i], NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+
+    for (i = 0; i < r->njobs; i++) {
+        free(r->jobs[i].in);
+        free(r->jobs[i].out);
+    }
+    free(r->jobs);
+    free(r->threads);
+    free(r->ibuf);
+    r->jobs = NULL;
+    r->threads = NULL;
+    r->ibuf = NULL;
+}
+
+/*
+ * Starts reading fd; nthreads <= 0 uses one thread per CPU. On failure
+ * returns -1 with the reason in r->errmsg.
+ */
+static inline int rkzip_reader_open(struct rkzip_reader *r, int fd,
+                                    int nthreads) {
+    const uint8_t *p;
+    ssize_t n;
+    int i;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) nthreads = 1;
+
+    if ((n = rkzip_fill(r, 6)) < 0) {
+        r->errmsg = strerror(errno);
+        free(r->ibuf);
+        return -1;
+    }
+    p = r->ibuf;
+    if (n >= 2 && !memcmp(p, "\x1f\x8b", 2))
+        r->method = RKZIP_GZIP;
+    else if (n >= 4 && !memcmp(p, "\x28\xb5\x2f\xfd", 4))
+        r->method = RKZIP_ZSTD;
+    else if (n >= 6 && !memcmp(p, "\xfd" "7zXZ\0", 6))
+        r->method = RKZIP_XZ;
+
+#ifndef HAVE_ZSTD
+    if (r->method == RKZIP_ZSTD) r->errmsg = "zstd input, not built in";
+#endif
+#ifndef HAVE_LZMA
+    if (r->method == RKZIP_XZ) r->errmsg = "xz input, not built in";
+#endif
+    if (r->errmsg) {
+        free(r->ibuf);
+        return -1;
+    }
+
+    /* xz brings its own threads, the rest are only read ahead */
+    if (r->method == RKZIP_GZIP || r->method == RKZIP_ZSTD)
+        r->njobs = 2 * nthreads + 2;
+    else
+        r->njobs = 4;
+    if (r->method == RKZIP_XZ)
+        r->xz_threads = nthreads;
+
+    r->jobs = calloc(r->njobs, sizeof(*r->jobs));
+    r->threads = calloc(nthreads, sizeof(*r->threads));
+    if (!r->jobs || !r->threads) {
+        free(r->jobs);
+        free(r->threads);
+        free(r->ibuf);
+        r->jobs = NULL;
+        r->errmsg = "out of memory";
+        return -1;
+    }
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->reader, NULL, rkzip_reader_main, r)) {
+        r->nthreads = 0;
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        free(r->jobs);
+        free(r->threads);
+        free(r->ibuf);
+        r->jobs = NULL;
+        r->errmsg = "cannot start reader thread";
+        return -1;
+    }
+    if (r->method == RKZIP_GZIP || r->method == RKZIP_ZSTD)
+        for (i = 0; i < nthreads; i++) {
+            if (pthread_create(&r->threads[i], NULL, rkzip_unzip_worker, r))
+                break;
+            r->nthreads++;
+        }
+    return 0;
+}
+
+/* Like read(), but only returns less than len at the end of the input */
+static inline ssize_t rkzip_read(struct rkzip_reader *r, void *data,
+                                 size_t len) {
+    uint8_t *p = data;
+    size_t n, got = 0;
+    int i;
+
+    while (got < len) {
+        if (!r->cur) {
+            pthread_mutex_lock(&r->lock);
+            for (;;) {
+                for (i = 0; i < r->njobs; i++)
+                    if (r->jobs[i].seq == r->seq_out &&
+                            r->jobs[i].state == RKZIP_READY)
+                        break;
+                if (i < r->njobs || r->error ||
+                        (r->eof && r->seq_out == r->seq_in))
+                    break;
+                pthread_cond_wait(&r->cond, &r->lock);
+            }
+            if (r->error) {
+                errno = r->error;
+                pthread_mutex_unlock(&r->lock);
+                return -1;
+            }
+            pthread_mutex_unlock(&r->lock);
+            if (i == r->njobs) break;
+            r->cur = &r->jobs[i];
+            r->cur_pos = 0;
+        }
+
+        n = r->cur->out_len - r->cur_pos;
+        if (n > len - got) n = len - got;
+        memcpy(p + got, r->cur->out + r->cur_pos, n);
+        r->cur_pos += n;
+        got += n;
+
+        if (r->cur_pos == r->cur->out_len) {
+            pthread_mutex_lock(&r->lock);
+            r->cur->state = RKZIP_FREE;
+            r->cur = NULL;
+            r->seq_out++;
+            pthread_cond_broadcast(&r->cond);
+            pthread_mutex_unlock(&r->lock);
+        }
+    }
+    r->bytes_out += got;
+    return got;
+}
+
+#endif /* _RKZIP_H_ */
@@ -1 +1 @@
-./fxload -d ddr.bin -u usb.bin
+./fxload -d ddr.bin -u usb.bin -f decode/firmware.bin